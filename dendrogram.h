@@ -0,0 +1,26 @@
+/* dendrogram.h : file format shared by the clustering driver (-l) and dendrogramQuery */
+#ifndef DENDROGRAM_H
+#define DENDROGRAM_H
+
+#define DENDROGRAM_VERSION 1
+
+/*
+ * A dendrogram file records every level of a multi-phase clustering:
+ *   header
+ *   numLevels parent arrays; array l has sizes[l] ids (idWidth bytes each,
+ *     padded to a multiple of 8 bytes) and maps node v of level l to its
+ *     cluster at level l+1, or -1 if v was not clustered
+ *   sizes[0..numLevels] (longs): sizes[0] = numVertices, sizes[l+1] is the
+ *     number of clusters formed from level l
+ * Level 0 is the input graph; the last level holds the final clusters. The
+ * sizes trail the arrays so that levels can be streamed out as phases finish.
+ */
+typedef struct dendrogramHeader {
+    char magic[8]; /* "CGDENDR" */
+    int version; /* DENDROGRAM_VERSION */
+    int idWidth; /* 4 or 8 bytes per parent id */
+    long numLevels; /* number of parent arrays */
+    long numVertices; /* nodes at level 0 */
+} dendrogramHeader;
+
+#endif
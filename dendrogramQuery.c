@@ -0,0 +1,181 @@
+#define _POSIX_C_SOURCE 200809L // For mmap()
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <omp.h>
+#include <stdbool.h> //For bool
+#include <fcntl.h> //For open()
+#include <unistd.h> //For close()
+#include <sys/mman.h> //For mmap()
+#include <sys/stat.h> //For fstat()
+#include "dendrogram.h"
+
+// Query a dendrogram written by driverForGraphClusteringParallel -l: project
+// input vertices to any level of the hierarchy without clustering again.
+
+// struct : levelMap
+// A mapped dendrogram file
+typedef struct levelMap {
+    void *base;
+    size_t size;
+    int idWidth;
+    long numLevels;
+    const long *sizes; /* sizes[0..numLevels] */
+    const char **parents; /* start of the parent array of every level */
+} levelMap;
+
+// function : openDendrogram
+// Map and check a dendrogram file; returns false on failure
+bool openDendrogram(levelMap* D, const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open file %s\n", filename);
+        return false;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(dendrogramHeader))) {
+        fprintf(stderr, "File %s is too small to be a dendrogram\n", filename);
+        close(fd);
+        return false;
+    }
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Cannot map file %s\n", filename);
+        return false;
+    }
+    const dendrogramHeader* header = (const dendrogramHeader*)base;
+    const char* problem = NULL;
+    if (strncmp(header->magic, "CGDENDR", 8) != 0) {
+        problem = "not a dendrogram file (or it was not closed)";
+    } else if (header->version != DENDROGRAM_VERSION) {
+        problem = "unsupported format version";
+    } else if (((header->idWidth != 4) && (header->idWidth != 8)) || (header->numLevels < 0) ||
+               ((size_t)st.st_size < sizeof(dendrogramHeader) + (header->numLevels+1)*sizeof(long))) {
+        problem = "corrupt header";
+    }
+    if (problem != NULL) {
+        fprintf(stderr, "Cannot load %s: %s\n", filename, problem);
+        munmap(base, st.st_size);
+        return false;
+    }
+    D->base = base;
+    D->size = st.st_size;
+    D->idWidth = header->idWidth;
+    D->numLevels = header->numLevels;
+    D->sizes = (const long*)((const char*)base + st.st_size) - (header->numLevels+1);
+    D->parents = (const char**)malloc((header->numLevels+1)*sizeof(char*));
+    assert(D->parents != 0);
+    const char* next = (const char*)(header + 1);
+    for (long l = 0; l < D->numLevels; l++) {
+        D->parents[l] = next;
+        next += ((D->sizes[l]*D->idWidth + 7) / 8) * 8;
+    }
+    if ((D->sizes[0] != header->numVertices) || (next != (const char*)D->sizes)) {
+        fprintf(stderr, "Cannot load %s: level sizes do not match the file\n", filename);
+        free(D->parents);
+        munmap(base, st.st_size);
+        return false;
+    }
+    return true;
+} // End of openDendrogram
+
+// function : parentOf
+// Cluster at level l+1 of node v of level l, -1 if v was not clustered
+static inline long parentOf(const levelMap* D, long l, long v) {
+    if (D->idWidth == 4) {
+        return ((const int*)D->parents[l])[v];
+    }
+    return ((const long*)D->parents[l])[v];
+}
+
+// function : projectVertex
+// Node of the given level that input vertex v belongs to, -1 if it dropped out
+long projectVertex(const levelMap* D, long v, long level) {
+    for (long l = 0; (l < level) && (v >= 0); l++) {
+        v = parentOf(D, l, v);
+    }
+    return v;
+} // End of projectVertex
+
+// function : printUsage
+void printUsage() {
+    printf("***************************************************************************************\n");
+    printf("Usage: dendrogramQuery <FileName>_dendrogram [level [vertex ...]]\n");
+    printf("***************************************************************************************\n");
+    printf("No level      : print the number of nodes at every level\n");
+    printf("Level only    : print the cluster of every input vertex at that level, one per line\n");
+    printf("Level, ids    : print \"vertex cluster\" for the given input vertices\n");
+    printf("Level -1 is the top (final) level; level 0 is the input graph\n");
+    printf("***************************************************************************************\n");
+}
+
+// function : main
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printUsage();
+        return -1;
+    }
+    levelMap D;
+    if (!openDendrogram(&D, argv[1])) {
+        return -1;
+    }
+    if (argc == 2) {
+        printf("Number of levels : %ld (0 = input vertices, %ld coarsening levels)\n", D.numLevels+1, D.numLevels);
+        for (long l = 0; l <= D.numLevels; l++) {
+            printf("Level %ld : %ld nodes\n", l, D.sizes[l]);
+        }
+        free(D.parents);
+        munmap(D.base, D.size);
+        return 0;
+    }
+
+    long level = atol(argv[2]);
+    if (level < 0) {
+        level = D.numLevels;
+    }
+    if (level > D.numLevels) {
+        fprintf(stderr, "Level must be between 0 and %ld\n", D.numLevels);
+        free(D.parents);
+        munmap(D.base, D.size);
+        return -1;
+    }
+    long NV = D.sizes[0];
+    int status = 0;
+    if (argc == 3) {
+        // Whole projection, one level at a time over all vertices
+        long* cluster = (long*)malloc(NV*sizeof(long));
+        assert(cluster != 0);
+        #pragma omp parallel for
+        for (long v = 0; v < NV; v++) {
+            cluster[v] = v;
+        }
+        for (long l = 0; l < level; l++) {
+            #pragma omp parallel for
+            for (long v = 0; v < NV; v++) {
+                if (cluster[v] >= 0) {
+                    cluster[v] = parentOf(&D, l, cluster[v]);
+                }
+            }
+        }
+        setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+        for (long v = 0; v < NV; v++) {
+            printf("%ld\n", cluster[v]);
+        }
+        free(cluster);
+    } else {
+        for (int i = 3; i < argc; i++) {
+            long v = atol(argv[i]);
+            if ((v < 0) || (v >= NV)) {
+                fprintf(stderr, "Vertex %s is not between 0 and %ld\n", argv[i], NV-1);
+                status = -1;
+                continue;
+            }
+            printf("%ld %ld\n", v, projectVertex(&D, v, level));
+        }
+    }
+    free(D.parents);
+    munmap(D.base, D.size);
+    return status;
+} // End of main
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L // For mmap(), posix_madvise()
+#define _DEFAULT_SOURCE // For MAP_ANONYMOUS
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -8,9 +10,17 @@
 #include <unistd.h> //For getopts()
 #include <getopt.h> //For getopts()
 #include <stdbool.h> //For bool
+#include <fcntl.h> //For open()
+#include <sys/mman.h> //For mmap()
+#include <sys/stat.h> //For fstat()
+#include <limits.h> //For INT_MAX, LONG_MAX
+#include <pthread.h> //For the decompression reader thread
+#include <zlib.h> //For gzip-compressed inputs
+#ifdef HAVE_ZSTD
+#include <zstd.h> //For zstd-compressed inputs
+#endif
 #include "RngStream.h"
-
-#define MaxDegree 4096 // Increase if number of colors is larger, decrease if memory is not enough
+#include "dendrogram.h"
 
 //#define DEBUG
 //#define DEBUG_VF
@@ -23,29 +33,102 @@ static __inline__ unsigned long long rdtsc(void) {
     return ( (unsigned long long)lo)|( ((unsigned long long)hi)<<32 );
 }
 
+// Vertex ids and edge weights
+// Build with -DVERTEX_ID_32 for 32-bit vertex ids and -DWEIGHT_FLOAT for
+// single precision edge weights (see the variant targets in the Makefile).
+// Edge offsets (edgeListPtrs) stay 64-bit and degree sums stay double.
+#ifdef VERTEX_ID_32
+typedef int vertexId;
+#define VERTEX_ID_MAX INT_MAX
+#else
+typedef long vertexId;
+#define VERTEX_ID_MAX LONG_MAX
+#endif
+#ifdef WEIGHT_FLOAT
+typedef float edgeWeight;
+#else
+typedef double edgeWeight;
+#endif
+
 // struct : community
 typedef struct comm {
-    long size;
-    long degree;
+    vertexId size;
+    double degree; /* sum of the weighted degrees of the members */
 } comm;
 
-// struct : edge
-typedef struct edge {
-    long head;
-    long tail;
-    double weight;
-} edge;
-
 // struct : graph
+// Adjacencies are stored as a structure of arrays: the neighbors of vertex v
+// are edgeList[edgeListPtrs[v] .. edgeListPtrs[v+1]-1] and the weight of
+// edgeList[j] is edgeWeights[j]. The source vertex is implied by the row.
+// Unweighted graphs carry no weight array (edgeWeights == NULL): every edge
+// weighs 1 and the kernels count edges instead of loading weights.
 typedef struct graph {
     long numVertices; /* number of columns */
     long sVertices; /* number of rows - Bipartite graph : number of s vertices */
     /* Handle this later */
     long numEdges; /* Each edge stored twice but counted once */
     long *edgeListPtrs; /* start vertex of edge */
-    edge *edgeList; /* end vertex of edge */
+    vertexId *edgeList; /* end vertex of edge */
+    edgeWeight *edgeWeights; /* weight of edge, NULL if all weights are 1 */
+    long *vertexWeights; /* vertex weights of the input (METIS), NULL if none */
+    void *mapBase; /* mapped binary file holding the arrays, NULL if malloc'ed */
+    size_t mapSize; /* length of the mapping */
 } graph;
 
+// function : freeGraph
+// Release the arrays of G (unmapping them if they were loaded in place) and G itself
+void freeGraph(graph* G) {
+    if (G->mapBase != NULL) {
+        munmap(G->mapBase, G->mapSize);
+    } else {
+        free(G->edgeListPtrs);
+        free(G->edgeList);
+        free(G->edgeWeights);
+    }
+    free(G->vertexWeights);
+    free(G);
+}
+
+#define BINARY_GRAPH_VERSION 5
+
+// struct : sourceKey
+// Identity of a text input: a binary cache of it is valid only while all fields match
+typedef struct sourceKey {
+    long type; /* file type (-f) the input was parsed as, 0 if not a cache */
+    long size; /* bytes of the input file */
+    long mtime; /* modification time of the input file, in nanoseconds */
+    unsigned long hash; /* hashFileContents() of the input file */
+} sourceKey;
+
+// struct : binaryGraphHeader
+// Header of the native binary format (file type 7). It is followed by
+// edgeListPtrs (numVertices+1 longs), edgeList (numAdjacencies vertex ids),
+// edgeWeights (numAdjacencies weights, weighted graphs only), vertexWeights
+// and original vertex ids (numVertices longs each, only when present). Every
+// array starts on an 8-byte boundary, so the whole file can be mapped and
+// used in place without parsing.
+typedef struct binaryGraphHeader {
+    char magic[8]; /* "CGRAPHB" */
+    int version; /* layout version, BINARY_GRAPH_VERSION */
+    int idWidth; /* bytes per vertex id */
+    int weighted; /* 1 if edgeWeights is stored, 0 if all weights are 1 */
+    int weightWidth; /* bytes per edge weight */
+    int hasVertexWeights; /* 1 if vertexWeights is stored */
+    int hasOrigIds; /* 1 if the original ids of sparse-id inputs are stored */
+    long numVertices;
+    long numEdges; /* as stored in graph.numEdges */
+    long numAdjacencies; /* length of edgeList, edgeListPtrs[numVertices] */
+    sourceKey source; /* text input this file caches (-k), zeros for -b */
+} binaryGraphHeader;
+
+// function : binaryPadded
+// Bytes taken by an array in a binary graph file, padded to keep the next one aligned
+size_t binaryPadded(size_t bytes) {
+    return ((bytes + 7) / 8) * 8;
+}
+
+#define MAX_RESOLUTIONS 64
+
 // struct : clusteringParams
 // For storing parameters needed as input
 // from the user of the code
@@ -54,6 +137,21 @@ typedef struct clusteringParams {
     int fType; // file type
     //bool strongScaling; // enable strong scaling - unsure what to do with this right now
     bool output; // print out the clustering data
+    bool levels; // write every phase to a dendrogram file
+    int outWidth; // 0 for text output, 4 or 8 for binary int32/int64 output
+    const char* binFile; // write the input as a binary graph (file type 7) and exit
+    const char* spillDir; // out-of-core loading: directory for the spilled adjacency arrays
+    const char* batchFile; // edge insertions and deletions applied after loading
+    const char* priorFile; // clusters before the batch (incremental mode)
+    const char* startFile; // initial clusters (warm start)
+    bool coarsenStart; // aggregate the initial clusters before any local moving
+    bool check; // validate the graph after loading
+    bool pruneInactive; // only re-evaluate vertices near the previous moves
+    bool refine; // Leiden-style refinement before every aggregation
+    double resolutions[MAX_RESOLUTIONS]; // modularity resolutions, clustered concurrently if several
+    int numResolutions;
+    bool repair; // validate and repair the graph after loading
+    bool cache; // load text inputs through a binary sidecar cache
     bool VF; // control for turning vertex following on/off
     bool coloring; // control for turning graph coloring on/off
     double C_thresh; // threshold with coloring on
@@ -67,6 +165,21 @@ void setDefaultParams(clusteringParams* inputParams) {
     inputParams->fType = 5;
     //inputParams->strongScaling = false;
     inputParams->output = false;
+    inputParams->levels = false;
+    inputParams->outWidth = 0;
+    inputParams->binFile = NULL;
+    inputParams->spillDir = NULL;
+    inputParams->batchFile = NULL;
+    inputParams->priorFile = NULL;
+    inputParams->startFile = NULL;
+    inputParams->coarsenStart = false;
+    inputParams->check = false;
+    inputParams->pruneInactive = false;
+    inputParams->refine = false;
+    inputParams->resolutions[0] = 1.0;
+    inputParams->numResolutions = 1;
+    inputParams->repair = false;
+    inputParams->cache = false;
     inputParams->VF = false;
     inputParams->coloring = false;
     inputParams->C_thresh = 0.01;
@@ -90,7 +203,21 @@ void printUsage() {
     //    printf("Strong scaling : -s         -- default=false\n");
     printf("VF             : -v         -- default=false\n");
     printf("Output         : -o         -- default=false\n");
+    printf("Output format  : -w <32|64> -- binary int32/int64 clusters instead of text (implies -o)\n");
+    printf("Levels         : -l         -- write all phases to <FileName>_dendrogram\n");
+    printf("Convert        : -b <file>  -- write the input as a binary graph (-f 7) and exit\n");
+    printf("Cache          : -k         -- reuse/refresh the binary cache <FileName>.cgb\n");
+    printf("Out-of-core    : -x <dir>   -- keep the METIS adjacencies in a spill file in <dir>\n");
+    printf("Check input    : -a         -- check symmetry, ranges, self-loops and duplicates\n");
+    printf("Repair input   : -r         -- check, then symmetrize, merge duplicates, drop self-loops\n");
+    printf("Edge batch     : -j <file>  -- apply \"+ u v [w]\" / \"- u v\" lines to the loaded graph\n");
+    printf("Incremental    : -i <file>  -- with -j: start from these clusters, near the batch only\n");
+    printf("Warm start     : -p <file>  -- start from these clusters (one id per line) on all vertices\n");
+    printf("Coarsen start  : -n         -- with -p/-i: aggregate the start clusters before local moving\n");
     printf("Coloring       : -c         -- default=false\n");
+    printf("Active set     : -u         -- re-evaluate only moved vertices and their neighbors\n");
+    printf("Refinement     : -e         -- split clusters into well-connected parts before aggregating\n");
+    printf("Resolution     : -g <list>  -- default=1; comma-separated values are clustered concurrently\n");
     printf("--------------------------------------------------------------------------------------\n");
     printf("Min-size       : -m <value> -- default=100000\n");
     printf("C-threshold    : -d <value> -- default=0.01\n");
@@ -104,7 +231,7 @@ bool parseInputParams(int numOfArgs, char** stringOfArgs, clusteringParams* inpu
 #ifdef DETAILED
     printf("Inside parseInputParams\n");
 #endif
-    static const char *opt_string = "csvof:t:d:m:";
+    static const char *opt_string = "csvoklaruenb:f:t:d:m:w:x:g:i:j:p:";
     int opt = getopt(numOfArgs, stringOfArgs, opt_string);
     while (opt != -1) {
         switch(opt) {
@@ -121,6 +248,73 @@ bool parseInputParams(int numOfArgs, char** stringOfArgs, clusteringParams* inpu
             case 'o' : 
                 inputParams->output=true;
                 break;
+            case 'w' :
+                inputParams->output=true;
+                inputParams->outWidth=atoi(optarg)/8;
+                if ((inputParams->outWidth != 4) && (inputParams->outWidth != 8)) {
+                    printf("Output width must be 32 or 64\n");
+                    return false;
+                }
+                break;
+            case 'l' :
+                inputParams->levels=true;
+                break;
+            case 'x' :
+                inputParams->spillDir=optarg;
+                break;
+            case 'j' :
+                inputParams->batchFile=optarg;
+                break;
+            case 'i' :
+                inputParams->priorFile=optarg;
+                break;
+            case 'p' :
+                inputParams->startFile=optarg;
+                break;
+            case 'n' :
+                inputParams->coarsenStart=true;
+                break;
+            case 'a' :
+                inputParams->check=true;
+                break;
+            case 'r' :
+                inputParams->check=true;
+                inputParams->repair=true;
+                break;
+            case 'e' :
+                inputParams->refine=true;
+                break;
+            case 'g' : {
+                char* next = optarg;
+                inputParams->numResolutions = 0;
+                while (true) {
+                    char* end;
+                    double value = strtod(next, &end);
+                    if ((end == next) || (value <= 0) || ((*end != ',') && (*end != '\0'))) {
+                        printf("Resolutions must be positive numbers separated by commas\n");
+                        return false;
+                    }
+                    if (inputParams->numResolutions == MAX_RESOLUTIONS) {
+                        printf("At most %d resolutions can be given\n", MAX_RESOLUTIONS);
+                        return false;
+                    }
+                    inputParams->resolutions[inputParams->numResolutions++] = value;
+                    if (*end == '\0') {
+                        break;
+                    }
+                    next = end + 1;
+                }
+                break;
+            }
+            case 'u' :
+                inputParams->pruneInactive=true;
+                break;
+            case 'k' :
+                inputParams->cache=true;
+                break;
+            case 'b' :
+                inputParams->binFile=optarg;
+                break;
             case 'f' : 
                 inputParams->fType=atoi(optarg);
                 if( (inputParams->fType > 8) || (inputParams->fType < 0) ) {
@@ -156,6 +350,18 @@ bool parseInputParams(int numOfArgs, char** stringOfArgs, clusteringParams* inpu
         }
         opt = getopt(numOfArgs, stringOfArgs, opt_string);
     }
+    if ((inputParams->priorFile != NULL) && (inputParams->batchFile == NULL)) {
+        printf("Incremental mode (-i) needs the edge batch (-j)\n");
+        return false;
+    }
+    if ((inputParams->priorFile != NULL) && (inputParams->startFile != NULL)) {
+        printf("Give the start clusters either with -i or with -p\n");
+        return false;
+    }
+    if (inputParams->coarsenStart && (inputParams->priorFile == NULL) && (inputParams->startFile == NULL)) {
+        printf("-n needs start clusters (-p or -i)\n");
+        return false;
+    }
     if ((numOfArgs - optind) != 1) {
         printf("Problem name is not specified\n");
         printUsage();
@@ -201,425 +407,2649 @@ bool parseInputParams(int numOfArgs, char** stringOfArgs, clusteringParams* inpu
     return true;
 }
 
-// function : strPosWithOffset
-long strPosWithOffset(char* line, char* delimiter, long offset) {
-    char lineArr[strlen(line) - offset];
-    strncpy(lineArr, line + offset, strlen(line) - offset);
-    char *found = strstr(lineArr, delimiter);
-    return(found - lineArr + offset);
+// function : parallelPrefixSum
+// In-place inclusive prefix sum of arr[0..n), computed with all threads
+void parallelPrefixSum(long* arr, long n) {
+    int nT = omp_get_max_threads();
+    if ((nT == 1) || (n < 100000)) {
+        for (long i = 1; i < n; i++) {
+            arr[i] += arr[i-1];
+        }
+        return;
+    }
+    long* blockSum = (long*)malloc((nT+1) * sizeof(long));
+    assert(blockSum != 0);
+    #pragma omp parallel num_threads(nT)
+    {
+        //The team may be smaller than requested (thread limit, nested runs)
+        int nth = omp_get_num_threads();
+        int t = omp_get_thread_num();
+        long begin = (n * t) / nth;
+        long end = (n * (t+1)) / nth;
+        for (long i = begin+1; i < end; i++) {
+            arr[i] += arr[i-1];
+        }
+        blockSum[t+1] = (end > begin) ? arr[end-1] : 0;
+        #pragma omp barrier
+        #pragma omp single
+        {
+            blockSum[0] = 0;
+            for (int b = 0; b < nth; b++) {
+                blockSum[b+1] += blockSum[b];
+            }
+        }
+        long offset = blockSum[t];
+        for (long i = begin; i < end; i++) {
+            arr[i] += offset;
+        }
+    }
+    free(blockSum);
+} // End of parallelPrefixSum
+
+// function : compareLongs
+int compareLongs(const void* a, const void* b) {
+    long x = *(const long*)a;
+    long y = *(const long*)b;
+    return (x > y) - (x < y);
 }
 
-// function : strPos
-long strPos(char* line, char* delimiter) {
-    char *found = strstr(line, delimiter);
-    return(found - line);
-}
+// function : parallelSortLongs
+// Sort arr[0..n) in ascending order: every thread sorts one block, then the
+// blocks are merged pairwise in parallel
+void parallelSortLongs(long* arr, long n) {
+    int nT = omp_get_max_threads();
+    if ((nT == 1) || (n < 100000)) {
+        qsort(arr, n, sizeof(long), compareLongs);
+        return;
+    }
+    long* tmp = (long*)malloc(n * sizeof(long));
+    assert(tmp != 0);
+    #pragma omp parallel for schedule(static, 1)
+    for (int b = 0; b < nT; b++) {
+        long begin = (n * b) / nT;
+        long end = (n * (b+1)) / nT;
+        qsort(arr + begin, end - begin, sizeof(long), compareLongs);
+    }
+    for (int width = 1; width < nT; width *= 2) {
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int b = 0; b < nT; b += 2*width) {
+            long begin = (n * b) / nT;
+            long mid = (n * ((b+width < nT) ? b+width : nT)) / nT;
+            long end = (n * ((b+2*width < nT) ? b+2*width : nT)) / nT;
+            long i = begin, j = mid, k = begin;
+            while ((i < mid) && (j < end)) {
+                tmp[k++] = (arr[j] < arr[i]) ? arr[j++] : arr[i++];
+            }
+            while (i < mid) {
+                tmp[k++] = arr[i++];
+            }
+            while (j < end) {
+                tmp[k++] = arr[j++];
+            }
+            memcpy(arr + begin, tmp + begin, (end - begin) * sizeof(long));
+        }
+    }
+    free(tmp);
+} // End of parallelSortLongs
+
+// Compressed inputs are decompressed while they load: a reader thread keeps a
+// small ring of raw blocks filled from disk, and the main thread inflates them
+// straight into an anonymous mapping. Callers see one contiguous buffer they
+// release with munmap(), exactly as for a mapped plain file.
+#define INPUT_RING_SLOTS 4
+#define INPUT_RING_BLOCK (4L << 20)
+#define INPUT_GZIP 1
+#define INPUT_ZSTD 2
+
+typedef struct {
+    int fd;
+    char* block[INPUT_RING_SLOTS];
+    size_t length[INPUT_RING_SLOTS];
+    long produced, consumed; // Number of blocks filled / released so far
+    bool done, failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} inputRing;
+
+// function : inputRingReader
+// Background thread: read the compressed file block by block into free slots
+void* inputRingReader(void* arg) {
+    inputRing* R = (inputRing*)arg;
+    while (1) {
+        pthread_mutex_lock(&R->lock);
+        while (R->produced - R->consumed == INPUT_RING_SLOTS && !R->failed)
+            pthread_cond_wait(&R->changed, &R->lock);
+        bool stop = R->failed; // The consumer gave up
+        long slot = R->produced % INPUT_RING_SLOTS;
+        pthread_mutex_unlock(&R->lock);
+        if (stop)
+            return NULL;
+        size_t got = 0;
+        while (got < INPUT_RING_BLOCK) {
+            ssize_t r = read(R->fd, R->block[slot] + got, INPUT_RING_BLOCK - got);
+            if (r < 0) {
+                pthread_mutex_lock(&R->lock);
+                R->failed = true;
+                pthread_cond_broadcast(&R->changed);
+                pthread_mutex_unlock(&R->lock);
+                return NULL;
+            }
+            if (r == 0)
+                break;
+            got += r;
+        }
+        pthread_mutex_lock(&R->lock);
+        if (got > 0) {
+            R->length[slot] = got;
+            R->produced++;
+        }
+        if (got < INPUT_RING_BLOCK)
+            R->done = true;
+        pthread_cond_broadcast(&R->changed);
+        pthread_mutex_unlock(&R->lock);
+        if (got < INPUT_RING_BLOCK)
+            return NULL;
+    }
+} // End of inputRingReader
+
+// function : inputRingNext
+// Wait for the next filled block; returns NULL at end of file or on error
+char* inputRingNext(inputRing* R, size_t* length) {
+    pthread_mutex_lock(&R->lock);
+    while (R->produced == R->consumed && !R->done && !R->failed)
+        pthread_cond_wait(&R->changed, &R->lock);
+    char* block = NULL;
+    if (R->produced > R->consumed && !R->failed) {
+        long slot = R->consumed % INPUT_RING_SLOTS;
+        block = R->block[slot];
+        *length = R->length[slot];
+    }
+    pthread_mutex_unlock(&R->lock);
+    return block;
+} // End of inputRingNext
+
+// function : inputRingRelease
+// Hand the block returned by inputRingNext back to the reader
+void inputRingRelease(inputRing* R, bool abort) {
+    pthread_mutex_lock(&R->lock);
+    if (abort)
+        R->failed = true;
+    else
+        R->consumed++;
+    pthread_cond_broadcast(&R->changed);
+    pthread_mutex_unlock(&R->lock);
+} // End of inputRingRelease
+
+// function : reserveOutput
+// Make sure at least minFree bytes follow the used part of an anonymous mapping
+bool reserveOutput(char** out, size_t* capacity, size_t used, size_t minFree) {
+    if (*capacity - used >= minFree)
+        return true;
+    size_t newCapacity = 2 * (*capacity);
+    if (newCapacity < used + minFree)
+        newCapacity = used + minFree;
+    char* grown = (char*)mmap(NULL, newCapacity, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (grown == MAP_FAILED)
+        return false;
+    memcpy(grown, *out, used);
+    munmap(*out, *capacity);
+    *out = grown;
+    *capacity = newCapacity;
+    return true;
+} // End of reserveOutput
+
+// function : decompressInputFile
+// Stream a gzip or zstd file through the reader ring into one anonymous mapping;
+// returns NULL on failure
+char* decompressInputFile(const char* filename, int fd, size_t compressedSize,
+                          int kind, size_t* fileSize) {
+#ifndef HAVE_ZSTD
+    if (kind == INPUT_ZSTD) {
+        fprintf(stderr, "File %s is zstd-compressed; rebuild with -DHAVE_ZSTD and -lzstd\n", filename);
+        close(fd);
+        return NULL;
+    }
+#endif
+    inputRing R;
+    R.fd = fd;
+    for (int i = 0; i < INPUT_RING_SLOTS; i++) {
+        R.block[i] = (char*)malloc(INPUT_RING_BLOCK);
+        assert(R.block[i] != 0);
+    }
+    R.produced = R.consumed = 0;
+    R.done = R.failed = false;
+    pthread_mutex_init(&R.lock, NULL);
+    pthread_cond_init(&R.changed, NULL);
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, inputRingReader, &R) != 0) {
+        fprintf(stderr, "Cannot start the reader thread for %s\n", filename);
+        for (int i = 0; i < INPUT_RING_SLOTS; i++)
+            free(R.block[i]);
+        close(fd);
+        return NULL;
+    }
 
-// function : subStrStartFromOfLen
-void subStrStartFromOfLen(char* str, long pos, long len, char* dest) {
-#ifdef DEBUG
-    printf("Inside subStrStartFromOfLen\n");
-    printf("str : %s\n", str);
-    printf("pos : %ld\n", pos);
-    printf("len : %ld\n", len);
+    // Text graphs usually compress 3-6x; start there and double as needed
+    size_t capacity = 4 * compressedSize + INPUT_RING_BLOCK;
+    size_t used = 0;
+    char* out = (char*)mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool ok = (out != MAP_FAILED);
+    bool streamEnded = false; // Last frame/member complete
+    if (!ok)
+        out = NULL;
+
+    z_stream zs;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream* zds = NULL;
 #endif
-    long l = strlen(str) - pos;
-    char* strArr = (char*)malloc(l);
-    strncpy(strArr, str+pos, l);
-    strArr[l] = '\0';
-#ifdef DEBUG
-    printf("strArr : %s\n", strArr);
+    if (ok && kind == INPUT_GZIP) {
+        memset(&zs, 0, sizeof(zs));
+        ok = (inflateInit2(&zs, 15 + 32) == Z_OK); // Accept gzip and zlib headers
+    }
+#ifdef HAVE_ZSTD
+    if (ok && kind == INPUT_ZSTD) {
+        zds = ZSTD_createDStream();
+        ok = (zds != NULL && !ZSTD_isError(ZSTD_initDStream(zds)));
+    }
 #endif
-    strncpy(dest, strArr, len);
-    dest[len] = '\0';
-    free(strArr);
-#ifdef DEBUG
-    printf("dest : %ld\n", strlen(dest));
+
+    size_t length;
+    char* block;
+    while (ok && (block = inputRingNext(&R, &length)) != NULL) {
+        size_t pos = 0;
+        while (ok && pos < length) {
+            if (!reserveOutput(&out, &capacity, used, INPUT_RING_BLOCK)) {
+                ok = false;
+                break;
+            }
+            if (kind == INPUT_GZIP) {
+                if (streamEnded) { // Concatenated gzip members
+                    ok = (inflateReset(&zs) == Z_OK);
+                    streamEnded = false;
+                }
+                zs.next_in = (unsigned char*)(block + pos);
+                zs.avail_in = (unsigned int)(length - pos);
+                zs.next_out = (unsigned char*)(out + used);
+                zs.avail_out = (unsigned int)(capacity - used > UINT_MAX ? UINT_MAX : capacity - used);
+                unsigned int availOut = zs.avail_out;
+                int rc = inflate(&zs, Z_NO_FLUSH);
+                if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+                    ok = false;
+                used += availOut - zs.avail_out;
+                pos = length - zs.avail_in;
+                if (rc == Z_STREAM_END)
+                    streamEnded = true;
+            }
+#ifdef HAVE_ZSTD
+            else {
+                ZSTD_inBuffer in = { block, length, pos };
+                ZSTD_outBuffer o = { out, capacity, used };
+                size_t rc = ZSTD_decompressStream(zds, &o, &in);
+                if (ZSTD_isError(rc))
+                    ok = false;
+                used = o.pos;
+                pos = in.pos;
+                streamEnded = (rc == 0);
+            }
+#endif
+        }
+        inputRingRelease(&R, !ok);
+    }
+    if (ok && R.failed) {
+        fprintf(stderr, "Read error on %s\n", filename);
+        ok = false;
+    }
+    // Flush whatever the decoder still holds for the final block
+    while (ok && !streamEnded && kind == INPUT_GZIP) {
+        if (!reserveOutput(&out, &capacity, used, INPUT_RING_BLOCK)) {
+            ok = false;
+            break;
+        }
+        zs.next_in = NULL;
+        zs.avail_in = 0;
+        zs.next_out = (unsigned char*)(out + used);
+        zs.avail_out = (unsigned int)(capacity - used > UINT_MAX ? UINT_MAX : capacity - used);
+        unsigned int availOut = zs.avail_out;
+        int rc = inflate(&zs, Z_FINISH);
+        used += availOut - zs.avail_out;
+        if (rc == Z_STREAM_END)
+            streamEnded = true;
+        else if (availOut == zs.avail_out)
+            break; // No progress: truncated input
+    }
+    if (ok && !streamEnded) {
+        fprintf(stderr, "File %s is truncated or corrupt\n", filename);
+        ok = false;
+    }
+
+    inputRingRelease(&R, true); // Unblock the reader if we stopped early
+    pthread_join(reader, NULL);
+    close(fd);
+    pthread_mutex_destroy(&R.lock);
+    pthread_cond_destroy(&R.changed);
+    for (int i = 0; i < INPUT_RING_SLOTS; i++)
+        free(R.block[i]);
+    if (kind == INPUT_GZIP && out != NULL)
+        inflateEnd(&zs);
+#ifdef HAVE_ZSTD
+    if (zds != NULL)
+        ZSTD_freeDStream(zds);
 #endif
-    return;
-}
 
-// function : remove_newline_ch
-void remove_newline_ch(char *line) {
-    int new_line = strlen(line) -1;
-    if (line[new_line] == '\n') {
-        line[new_line] = '\0';
+    if (!ok || used == 0) {
+        if (ok)
+            fprintf(stderr, "File %s is empty after decompression\n", filename);
+        else
+            fprintf(stderr, "Cannot decompress file %s\n", filename);
+        if (out != NULL)
+            munmap(out, capacity);
+        return NULL;
     }
-    return;
+    // Trim the unused tail so that munmap(data, *fileSize) releases everything
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t keep = (used + page - 1) / page * page;
+    if (keep < capacity)
+        munmap(out + keep, capacity - keep);
+    mprotect(out, keep, PROT_READ);
+    *fileSize = used;
+    return out;
+} // End of decompressInputFile
+
+// function : mapInputFile
+// Map the whole file read-only, or decompress it when it starts with a gzip or
+// zstd magic number; returns NULL on failure
+char* mapInputFile(const char* filename, size_t* fileSize) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open file %s\n", filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Cannot read file %s (empty or not a regular file)\n", filename);
+        close(fd);
+        return NULL;
+    }
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    if (pread(fd, magic, 4, 0) >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return decompressInputFile(filename, fd, st.st_size, INPUT_GZIP, fileSize);
+    if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return decompressInputFile(filename, fd, st.st_size, INPUT_ZSTD, fileSize);
+    char* data = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map file %s\n", filename);
+        return NULL;
+    }
+    posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+    *fileSize = st.st_size;
+    return data;
+} // End of mapInputFile
+
+// function : nextLine
+// Return the start of the line following p, or end
+static inline const char* nextLine(const char* p, const char* end) {
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    return (nl == NULL) ? end : nl + 1;
 }
 
-// function : trimTrailing
-void trimTrailing(char * str) {
-    long len = strlen(str) - 1;
-    if (str[len] == ' ') {
-        str[len] = '\0';
+// function : skipBlanks
+static inline const char* skipBlanks(const char* p, const char* end) {
+    while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r'))) {
+        p++;
     }
+    return p;
 }
 
-// function : countTokens
-long countTokens(char* line, char* delimiter) {
-#ifdef DEBUG
-    printf("Inside countTokens\n");
-    printf("Input line is .%s.\n", line);
-    printf("Input delimiter is .%s.\n", delimiter);
-#endif
-    // initialize count to 1
-    long count = 1;
-    long delimiterPos = 0, lastPos = 0;
-    long lineLen = strlen(line);
-    long delimiterLen = strlen(delimiter);
-#ifdef DEBUG
-    printf("lineLen is %ld\n", lineLen);
-    printf("delimiterLen is %ld\n", delimiterLen);
-#endif
-    char* tempStr = (char*)malloc(delimiterLen);
-
-    // if lineLen is 0 
-    // obviously there are 0 tokens
-    if (lineLen == 0) {
-        return 0;
+// function : scanLong
+// Parse a decimal integer starting at p (no leading blanks).
+// Returns the position after the number, or p if there is no number.
+static inline const char* scanLong(const char* p, const char* end, long* value) {
+    const char* q = p;
+    bool negative = false;
+    if ((q < end) && ((*q == '-') || (*q == '+'))) {
+        negative = (*q == '-');
+        q++;
     }
-    // if delimiterLen is 0
-    // obviously there is 1 token
-    if (delimiterLen == 0) {
-        return 1;
+    const char* digits = q;
+    long v = 0;
+    while ((q < end) && (*q >= '0') && (*q <= '9')) {
+        v = v*10 + (*q - '0');
+        q++;
     }
+    if (q == digits) {
+        return p;
+    }
+    *value = negative ? -v : v;
+    return q;
+}
 
-    while(1) {
-#ifdef DEBUG
-        printf("Inside while loop, delimiterPos is %ld\n", delimiterPos);
-#endif
-        delimiterPos = strPosWithOffset(line, delimiter, delimiterPos);
-#ifdef DEBUG
-        printf("Inside while loop, count is %ld\n", count);
-        printf("Inside while loop, delimiterPos is %ld\n", delimiterPos);
-#endif
-        if (delimiterPos == 0) {
-            delimiterPos += delimiterLen;
-            continue;
-        }
-        if ( (delimiterPos < 0) || (delimiterPos >= lineLen) ) {
-#ifdef DEBUG
-            printf("Inside while loop, OMG, count is %ld\n", count);
-#endif
-            return count;
+// function : scanDouble
+// Parse a floating point number starting at p (no leading blanks).
+// Plain decimals are converted inline; exponents and long mantissas go
+// through strtod. Returns the position after the number, or p if there is
+// no number.
+static inline const char* scanDouble(const char* p, const char* end, double* value) {
+    const char* q = p;
+    bool negative = false;
+    if ((q < end) && ((*q == '-') || (*q == '+'))) {
+        negative = (*q == '-');
+        q++;
+    }
+    const char* digits = q;
+    long whole = 0, frac = 0, scale = 1;
+    while ((q < end) && (*q >= '0') && (*q <= '9') && (q - digits < 18)) {
+        whole = whole*10 + (*q - '0');
+        q++;
+    }
+    bool simple = (q == end) || ((*q < '0') || (*q > '9'));
+    if (simple && (q < end) && (*q == '.')) {
+        q++;
+        while ((q < end) && (*q >= '0') && (*q <= '9') && (scale < 1000000000000000000L/10)) {
+            frac = frac*10 + (*q - '0');
+            scale *= 10;
+            q++;
         }
-        //if (delimiterLen != (delimiterPos - lastPos)) {
-        long len = delimiterPos - lastPos;
-        subStrStartFromOfLen(line, lastPos, len, tempStr);
-        if (strcmp(tempStr, delimiter) != 0) {
-#ifdef DEBUG
-            printf("Inside while loop, OMG2, count is %ld\n", count);
-#endif
-            count++;
+    }
+    if (simple && ((q == end) || ((*q != 'e') && (*q != 'E') && ((*q < '0') || (*q > '9'))))) {
+        if ((q == digits) || ((q == digits+1) && (*digits == '.'))) {
+            return p;
         }
-        lastPos = delimiterPos;
-        delimiterPos += delimiterLen;
+        double v = (double)whole + (double)frac / (double)scale;
+        *value = negative ? -v : v;
+        return q;
     }
-#ifdef DEBUG
-    printf("Outside while loop, count is %ld\n", count);
-#endif
-    free(tempStr);
-    return count;
+    char buf[64];
+    int len = 0;
+    while ((p + len < end) && (len < 63) && (p[len] != ' ') && (p[len] != '\t')
+            && (p[len] != '\r') && (p[len] != '\n')) {
+        buf[len] = p[len];
+        len++;
     }
+    buf[len] = '\0';
+    char* stop;
+    double v = strtod(buf, &stop);
+    if (stop == buf) {
+        return p;
+    }
+    *value = v;
+    return p + (stop - buf);
+}
 
-    // function : getNextToken
-    long getNextToken(char* line, char* lineMod, char* delimiter) {
-#ifdef DEBUG
-        printf("Inside getNextToken\n");
-        printf("Value of line is %s\n", line);
-        printf("Value of lineMod is %s\n", lineMod);
-        printf("Value of delimiter is .%s.\n", delimiter);
-#endif
-        long lineLen = strlen(line);
-        long delimiterLen = strlen(delimiter);
-#ifdef DEBUG
-        printf("lineLen : %ld\n", lineLen);
-        printf("delimiterLen : %ld\n", delimiterLen);
-#endif
-        char* token = (char*)malloc(lineLen);
-        char* tempStr = (char*)malloc(delimiterLen);
-
-        if (lineLen == 0) {
-            return 0;
+// function : scanWord
+// Copy the blank-delimited word at p into word (lower case, at most
+// maxLen-1 characters) and return the position after it
+static inline const char* scanWord(const char* p, const char* end, char* word, int maxLen) {
+    int len = 0;
+    while ((p < end) && (*p != ' ') && (*p != '\t') && (*p != '\r') && (*p != '\n')) {
+        if (len < maxLen-1) {
+            word[len++] = (*p >= 'A' && *p <= 'Z') ? (*p - 'A' + 'a') : *p;
         }
+        p++;
+    }
+    word[len] = '\0';
+    return p;
+}
 
-        long delimiterPos = strPos(lineMod, delimiter);
-#ifdef DEBUG
-        printf("delimiterPos : %ld\n", delimiterPos);
-#endif
-        if (delimiterPos == 0) {
-            while(1) {
-                subStrStartFromOfLen(lineMod, 0, delimiterLen, tempStr);
-                strncpy(tempStr, lineMod, delimiterLen);
-#ifdef DEBUG
-                printf("tempStr : .%s.\n", tempStr);
-#endif
-                if (strcmp(tempStr, delimiter) == 0) {
-#ifdef DEBUG
-                    printf("lineMod : .%s.\n", lineMod);
-#endif
-                    long len = strlen(lineMod) - delimiterLen;
-                    memmove(lineMod, lineMod+delimiterLen, len);
-                    lineMod[len] = '\0';
-#ifdef DEBUG
-                    printf("lineMod : .%s.\n", lineMod);
-#endif
-                } else {
-#ifdef DEBUG
-                    printf("breaking out of while loop\n");
-#endif
-                    break;
-                }
-            }
-            delimiterPos = strPos(lineMod, delimiter);
-#ifdef DEBUG
-            printf("delimiterPos : %ld\n", delimiterPos);
-#endif
+// function : splitAtNewlines
+// Split [begin, end) into nChunks ranges that each start at a line boundary:
+// chunk c is [chunkStart[c], chunkStart[c+1])
+void splitAtNewlines(const char* begin, const char* end, int nChunks, const char** chunkStart) {
+    long len = end - begin;
+    chunkStart[0] = begin;
+    for (int c = 1; c < nChunks; c++) {
+        const char* p = begin + (len * c) / nChunks;
+        if (p < chunkStart[c-1]) {
+            p = chunkStart[c-1];
         }
-
-        if (delimiterPos < 0) {
-            long len = strlen(lineMod);
-            strncpy(token, lineMod, len);
-            token[len] = '\0';
-            lineMod[0] = '\0';
-            //memset(lineMod, '\0', strlen(lineMod));
-            //free(lineMod);
-#ifdef DEBUG
-            printf("lineMod : .%s.\n", lineMod);
-#endif
-        } else {
-            subStrStartFromOfLen(lineMod, 0, delimiterPos, token);
-            long len = strlen(lineMod)-delimiterPos-delimiterLen;
-            //strncpy(lineMod, lineMod+delimiterPos+delimiterLen, len);
-            memmove(lineMod, lineMod+delimiterPos+delimiterLen, len);
-            lineMod[len] = '\0';
-            delimiterPos = 0;
-            while(1) {
-                subStrStartFromOfLen(lineMod, 0, delimiterLen, tempStr);
-                if (tempStr == delimiter) {
-                    long loc = strlen(lineMod)-delimiterLen;
-                    memmove(lineMod, lineMod+delimiterLen, loc);
-                    //strncpy(lineMod, lineMod+delimiterLen, loc);
-                    lineMod[loc] = '\0';
-                } else {
-                    break;
-                }
+        chunkStart[c] = (p == begin) ? begin : nextLine(p-1, end);
+    }
+    chunkStart[nChunks] = end;
+} // End of splitAtNewlines
+
+// function : readEdgeLines
+// Tokenizer shared by the edge list formats. Parses the lines of
+// [begin, end) as "u v [w]" records: blank lines and lines starting with
+// one of the characters in skip are ignored, and anything after the third
+// column is ignored. The lines are split into one chunk per thread, counted,
+// and parsed straight into their slot of the output arrays.
+// On success returns the number of records and sets *first and *second;
+// if value is not NULL, *value gets the third column (1 where it is missing)
+// and *allUnit tells whether every value is 1.
+// Returns -1 if a record does not start with two integers.
+long readEdgeLines(const char* begin, const char* end, const char* skip,
+        long** first, long** second, double** value, bool* allUnit) {
+    int nChunks = omp_get_max_threads();
+    if ((end - begin) < (1L << 20)) {
+        nChunks = 1; // Not worth splitting small files
+    }
+    const char** chunkStart = (const char**)malloc((nChunks+1) * sizeof(char*));
+    long* chunkRecord = (long*)malloc((nChunks+1) * sizeof(long));
+    assert((chunkStart != 0) && (chunkRecord != 0));
+    splitAtNewlines(begin, end, nChunks, chunkStart);
+
+    // Step 1 : count the records of every chunk
+    chunkRecord[0] = 0;
+    #pragma omp parallel for schedule(static, 1)
+    for (int c = 0; c < nChunks; c++) {
+        long lines = 0;
+        for (const char* s = chunkStart[c]; s < chunkStart[c+1]; s = nextLine(s, end)) {
+            const char* t = skipBlanks(s, end);
+            if ((t < end) && (*t != '\n') && ((*t == '\0') || (strchr(skip, *t) == NULL))) {
+                lines++;
             }
         }
-        // free memory allocations
-        free(tempStr);
-        long ret = atol(token);
-        free(token);
-#ifdef DEBUG
-        printf("getNextToken : returning %ld\n", ret);
-#endif
-        return ret;
-    }
-
-    // function : findLongestLineSize
-    long findLongestLineSize(const char* filename) {
-        FILE* fin;
-        fin = fopen(filename, "r");
-        long iCount = 0;
-        long maxCount = 0;
-        char ch;
-
-        do {
-            if ((ch=fgetc(fin))!= EOF && ch!='\n') {
-                iCount++;
-            } else { 
-                if (iCount > maxCount) {
-                    maxCount = iCount;
-                }
-                iCount=0;
+        chunkRecord[c+1] = lines;
+    }
+    for (int c = 0; c < nChunks; c++) {
+        chunkRecord[c+1] += chunkRecord[c];
+    }
+    long numRecords = chunkRecord[nChunks];
+
+    // Step 2 : parse every record into place
+    long* u = (long*)malloc(numRecords * sizeof(long));
+    long* v = (long*)malloc(numRecords * sizeof(long));
+    assert((u != 0) && (v != 0));
+    double* w = NULL;
+    if (value != NULL) {
+        w = (double*)malloc(numRecords * sizeof(double));
+        assert(w != 0);
+    }
+    bool parseError = false;
+    int unit = 1;
+    #pragma omp parallel for schedule(static, 1) reduction(&&:unit)
+    for (int c = 0; c < nChunks; c++) {
+        long k = chunkRecord[c];
+        for (const char* s = chunkStart[c]; s < chunkStart[c+1]; s = nextLine(s, end)) {
+            const char* e = nextLine(s, end);
+            const char* t = skipBlanks(s, e);
+            if ((t == e) || (*t == '\n') || ((*t != '\0') && (strchr(skip, *t) != NULL))) {
+                continue;
+            }
+            const char* x = scanLong(t, e, &u[k]);
+            const char* y = (x == t) ? x : skipBlanks(x, e);
+            const char* z = (x == t) ? x : scanLong(y, e, &v[k]);
+            if ((x == t) || (z == y)) {
+                parseError = true;
+                break;
+            }
+            if (w != NULL) {
+                w[k] = 1;
+                scanDouble(skipBlanks(z, e), e, &w[k]); // Optional column
+                unit = unit && (w[k] == 1);
             }
-        } while (ch!=EOF);
-        fclose(fin);
-        return maxCount;
+            k++;
+        }
+    }
+    free(chunkStart);
+    free(chunkRecord);
+    if (parseError) {
+        free(u);
+        free(v);
+        free(w);
+        return -1;
+    }
+    *first = u;
+    *second = v;
+    if (value != NULL) {
+        *value = w;
+        *allUnit = unit;
+    }
+    return numRecords;
+} // End of readEdgeLines
+
+// function : convertEdgeRecords
+// Turn n records of readEdgeLines into zero-based vertex ids (subtracting
+// base) and edge weights (none if values is NULL). first must lie in
+// [base, base+firstLimit) and second in [base, base+secondLimit).
+// The records are freed. Returns false if an id is out of range.
+bool convertEdgeRecords(long n, long* first, long* second, double* values, long base,
+        long firstLimit, long secondLimit, vertexId** src, vertexId** dst, edgeWeight** wt) {
+    vertexId* s = (vertexId*)malloc(n * sizeof(vertexId));
+    vertexId* d = (vertexId*)malloc(n * sizeof(vertexId));
+    assert((s != 0) && (d != 0));
+    edgeWeight* w = NULL;
+    if (values != NULL) {
+        w = (edgeWeight*)malloc(n * sizeof(edgeWeight));
+        assert(w != 0);
+    }
+    bool rangeError = false;
+    #pragma omp parallel for reduction(||:rangeError)
+    for (long k = 0; k < n; k++) {
+        long a = first[k] - base;
+        long b = second[k] - base;
+        if ((a < 0) || (a >= firstLimit) || (b < 0) || (b >= secondLimit)) {
+            rangeError = true;
+            continue;
+        }
+        s[k] = a;
+        d[k] = b;
+        if (w != NULL) {
+            w[k] = values[k];
+        }
+    }
+    free(first);
+    free(second);
+    free(values);
+    if (rangeError) {
+        free(s);
+        free(d);
+        free(w);
+        return false;
     }
+    *src = s;
+    *dst = d;
+    *wt = w;
+    return true;
+} // End of convertEdgeRecords
 
-    // function : loadMetisFileFormat
-    // parse file in metis format
-    bool loadMetisFileFormat(graph *G, const char* filename) {
-#ifdef DETAILED
-        printf("Inside loadMetisFileFormat\n");
-#endif
-        long i, j, value, neighbor, mNVer = 0, mNEdge = 0;
-        double edgeWeight, vertexWeight;
-        size_t len = 0;
-        char* myDelimiter = " ";
-        char* oneLine;
+// function : lessAdjacency
+// Order of adjacency entries a and b in a row: by neighbor, then by weight
+static inline bool lessAdjacency(vertexId* ind, edgeWeight* wt, long a, long b) {
+    if (ind[a] != ind[b]) {
+        return ind[a] < ind[b];
+    }
+    return (wt != NULL) && (wt[a] < wt[b]);
+}
 
-        long maxLineLen = findLongestLineSize(filename);
-#ifdef DEBUG
-        printf("maxLineLen : %ld\n", maxLineLen);
-#endif
+// function : swapAdjacency
+static inline void swapAdjacency(vertexId* ind, edgeWeight* wt, long a, long b) {
+    vertexId t = ind[a];
+    ind[a] = ind[b];
+    ind[b] = t;
+    if (wt != NULL) {
+        edgeWeight w = wt[a];
+        wt[a] = wt[b];
+        wt[b] = w;
+    }
+}
 
-        FILE* fin;
-        char comment;
-        fin = fopen(filename, "r");
-        if (fin == NULL) {
-            fprintf(stderr, "Cannot open file %s\n", filename);
-            exit(0);
+// function : sortAdjacency
+// Sort one row of n entries in place, moving the weights (if any) along.
+// Insertion sort for short rows, heapsort otherwise.
+void sortAdjacency(vertexId* ind, edgeWeight* wt, long n) {
+    if (n <= 16) {
+        for (long i = 1; i < n; i++) {
+            for (long j = i; (j > 0) && lessAdjacency(ind, wt, j, j-1); j--) {
+                swapAdjacency(ind, wt, j, j-1);
+            }
         }
-
-        oneLine = (char*)malloc((maxLineLen+1)*sizeof(char));
-        // Ignore comments - line starting with '%'
-        do {
-            fgets(oneLine, maxLineLen, fin);
-            remove_newline_ch(oneLine);
-            trimTrailing(oneLine);
-            comment = oneLine[0];
-        } while (comment == '%' && !feof(fin));
-
-        char* oneLineMod = (char*)malloc(maxLineLen+1);
-        memset(oneLineMod, '\0', sizeof(oneLineMod));
-        if (oneLineMod) {
-            strcpy(oneLineMod, oneLine);
+        return;
+    }
+    for (long k = n-1; k >= 0; k--) { // Build a max-heap
+        for (long r = k, c; (c = 2*r + 1) < n; r = c) {
+            if ((c+1 < n) && lessAdjacency(ind, wt, c, c+1)) {
+                c++;
+            }
+            if (!lessAdjacency(ind, wt, r, c)) {
+                break;
+            }
+            swapAdjacency(ind, wt, r, c);
         }
-#ifdef DEBUG
-        printf("oneLine : %s\n", oneLine);
-        printf("oneLineMod : %s\n", oneLineMod);
-#endif
-        long count = countTokens(oneLineMod, myDelimiter);
-#ifdef DEBUG
-        printf("Inside loadMetisFileFormat, count is %ld\n", count);
-#endif
-        if (count) {
-            mNVer = getNextToken(oneLine, oneLineMod, myDelimiter);
-#ifdef DEBUG
-            printf("mNVer : %ld\n", mNVer);
-#endif
+    }
+    for (long last = n-1; last > 0; last--) { // Move the max to the end
+        swapAdjacency(ind, wt, 0, last);
+        for (long r = 0, c; (c = 2*r + 1) < last; r = c) {
+            if ((c+1 < last) && lessAdjacency(ind, wt, c, c+1)) {
+                c++;
+            }
+            if (!lessAdjacency(ind, wt, r, c)) {
+                break;
+            }
+            swapAdjacency(ind, wt, r, c);
         }
-        count = countTokens(oneLineMod, myDelimiter);
-        if (count) {
-            mNEdge = getNextToken(oneLine, oneLineMod, myDelimiter);
-#ifdef DEBUG
-            printf("mNEdge : %ld\n", mNEdge);
-#endif
+    }
+} // End of sortAdjacency
+
+// function : buildGraphFromEdgeList
+// Build the symmetric CSR of G from numEntries undirected edges
+// (src[k], dst[k]) with weights wt[k], or unit weights if wt is NULL.
+// Each edge is stored in both rows and a self-loop once; with
+// bothDirections the entries already list every edge from both ends and
+// each entry only goes to the row of src[k]. The rows are
+// filled with a parallel counting sort and then sorted by neighbor, so the
+// result does not depend on the number of threads. The input arrays are
+// left to the caller.
+void buildGraphFromEdgeList(graph* G, long NV, long numEntries,
+        vertexId* src, vertexId* dst, edgeWeight* wt, bool bothDirections) {
+    long* vtxPtr = (long*)malloc((NV+1) * sizeof(long));
+    assert(vtxPtr != 0);
+    #pragma omp parallel for
+    for (long i = 0; i <= NV; i++) {
+        vtxPtr[i] = 0;
+    }
+    // Count the entries of every row
+    long selfLoops = 0;
+    #pragma omp parallel for reduction(+:selfLoops)
+    for (long k = 0; k < numEntries; k++) {
+        __sync_fetch_and_add(&vtxPtr[src[k]+1], 1);
+        if (src[k] == dst[k]) {
+            selfLoops++;
+        } else if (!bothDirections) {
+            __sync_fetch_and_add(&vtxPtr[dst[k]+1], 1);
         }
-        count = countTokens(oneLineMod, myDelimiter);
-        if (count) { 
-            value = getNextToken(oneLine, oneLineMod, myDelimiter);
-#ifdef DEBUG
-            printf("value : %ld\n", value);
-#endif
-        } else {
-            value = 0;
+    }
+    parallelPrefixSum(vtxPtr+1, NV);
+    long numAdj = vtxPtr[NV];
+
+    vertexId* vtxInd = (vertexId*)malloc(numAdj * sizeof(vertexId));
+    assert(vtxInd != 0);
+    edgeWeight* vtxWt = NULL;
+    if (wt != NULL) {
+        vtxWt = (edgeWeight*)malloc(numAdj * sizeof(edgeWeight));
+        assert(vtxWt != 0);
+    }
+    long* cursor = (long*)malloc(NV * sizeof(long));
+    assert(cursor != 0);
+    #pragma omp parallel for
+    for (long i = 0; i < NV; i++) {
+        cursor[i] = vtxPtr[i];
+    }
+    // Drop every entry into its row(s)
+    #pragma omp parallel for
+    for (long k = 0; k < numEntries; k++) {
+        long Where = __sync_fetch_and_add(&cursor[src[k]], 1);
+        vtxInd[Where] = dst[k];
+        if (wt != NULL) {
+            vtxWt[Where] = wt[k];
         }
-        // free memory allocations
-        if (!oneLineMod) {
-            free(oneLineMod);
+        if ((src[k] != dst[k]) && !bothDirections) {
+            Where = __sync_fetch_and_add(&cursor[dst[k]], 1);
+            vtxInd[Where] = src[k];
+            if (wt != NULL) {
+                vtxWt[Where] = wt[k];
+            }
         }
+    }
+    free(cursor);
+    // Fix the order inside every row
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (long i = 0; i < NV; i++) {
+        sortAdjacency(vtxInd + vtxPtr[i], (vtxWt == NULL) ? NULL : vtxWt + vtxPtr[i],
+                vtxPtr[i+1] - vtxPtr[i]);
+    }
 
-        // Store vertex degree
-        long* mVerPtr = (long*)malloc((mNVer+1)*sizeof(long));
-        assert(mVerPtr != 0);
-        // Store edge information
-        edge* mEdgeList = (edge*)malloc((mNEdge*2)*sizeof(edge));
-        assert(mEdgeList != 0);
-
-        // Don't understand the point
-        //#pragma omp parallel for
-        for (i=0; i<=mNVer; i++) {
-            mVerPtr[i] = 0; // initialize to 0
+    G->numVertices = NV;
+    G->sVertices = NV;
+    G->numEdges = selfLoops + (numAdj - selfLoops)/2; // Self-loops are stored once
+    G->edgeListPtrs = vtxPtr;
+    G->edgeList = vtxInd;
+    G->edgeWeights = vtxWt;
+    G->vertexWeights = NULL;
+    G->mapBase = NULL;
+    G->mapSize = 0;
+} // End of buildGraphFromEdgeList
+
+// function : removeDuplicateEdges
+// Keep a single copy of every repeated neighbor in the sorted rows of an
+// unweighted G (as built by buildGraphFromEdgeList) and recount its edges
+void removeDuplicateEdges(graph* G) {
+    assert(G->edgeWeights == NULL);
+    long NV = G->numVertices;
+    long* vtxPtr = G->edgeListPtrs;
+    vertexId* vtxInd = G->edgeList;
+    long* newPtr = (long*)malloc((NV+1) * sizeof(long));
+    assert(newPtr != 0);
+    newPtr[0] = 0;
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (long i = 0; i < NV; i++) {
+        long unique = 0;
+        for (long j = vtxPtr[i]; j < vtxPtr[i+1]; j++) {
+            if ((j == vtxPtr[i]) || (vtxInd[j] != vtxInd[j-1])) {
+                unique++;
+            }
         }
-
-        // Don't understand the point
-        //#pragma omp parallel for
-        for (i=0; i<(2*mNEdge); i++) {
-            mEdgeList[i].tail = -1;
-            mEdgeList[i].weight = 0;
+        newPtr[i+1] = unique;
+    }
+    parallelPrefixSum(newPtr+1, NV);
+    long numAdj = newPtr[NV];
+    vertexId* newInd = (vertexId*)malloc(numAdj * sizeof(vertexId));
+    assert(newInd != 0);
+    long selfLoops = 0;
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+:selfLoops)
+    for (long i = 0; i < NV; i++) {
+        long Where = newPtr[i];
+        for (long j = vtxPtr[i]; j < vtxPtr[i+1]; j++) {
+            if ((j == vtxPtr[i]) || (vtxInd[j] != vtxInd[j-1])) {
+                newInd[Where++] = vtxInd[j];
+                if (vtxInd[j] == i) {
+                    selfLoops++;
+                }
+            }
+        }
+    }
+    free(vtxPtr);
+    free(vtxInd);
+    G->edgeListPtrs = newPtr;
+    G->edgeList = newInd;
+    G->numEdges = selfLoops + (numAdj - selfLoops)/2; // Self-loops are stored once
+} // End of removeDuplicateEdges
+
+// function : mergeDuplicateEdges
+// Weighted variant of removeDuplicateEdges: every repeated neighbor in the
+// sorted rows of G becomes one adjacency with the summed weight. Weights
+// that all end up 1 are dropped, as the loaders do.
+void mergeDuplicateEdges(graph* G) {
+    assert(G->edgeWeights != NULL);
+    long NV = G->numVertices;
+    long* vtxPtr = G->edgeListPtrs;
+    vertexId* vtxInd = G->edgeList;
+    edgeWeight* vtxWt = G->edgeWeights;
+    long* newPtr = (long*)malloc((NV+1) * sizeof(long));
+    assert(newPtr != 0);
+    newPtr[0] = 0;
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (long i = 0; i < NV; i++) {
+        long unique = 0;
+        for (long j = vtxPtr[i]; j < vtxPtr[i+1]; j++) {
+            if ((j == vtxPtr[i]) || (vtxInd[j] != vtxInd[j-1])) {
+                unique++;
+            }
+        }
+        newPtr[i+1] = unique;
+    }
+    parallelPrefixSum(newPtr+1, NV);
+    long numAdj = newPtr[NV];
+    vertexId* newInd = (vertexId*)malloc(numAdj * sizeof(vertexId));
+    assert(newInd != 0);
+    edgeWeight* newWt = (edgeWeight*)malloc(numAdj * sizeof(edgeWeight));
+    assert(newWt != 0);
+    long selfLoops = 0;
+    int allUnit = 1;
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+:selfLoops) reduction(&&:allUnit)
+    for (long i = 0; i < NV; i++) {
+        long Where = newPtr[i] - 1;
+        for (long j = vtxPtr[i]; j < vtxPtr[i+1]; j++) {
+            if ((j == vtxPtr[i]) || (vtxInd[j] != vtxInd[j-1])) {
+                Where++;
+                newInd[Where] = vtxInd[j];
+                newWt[Where] = 0;
+                if (vtxInd[j] == i) {
+                    selfLoops++;
+                }
+            }
+            newWt[Where] += vtxWt[j];
+        }
+        for (long j = newPtr[i]; j < newPtr[i+1]; j++) {
+            allUnit = allUnit && (newWt[j] == 1);
+        }
+    }
+    free(vtxPtr);
+    free(vtxInd);
+    free(vtxWt);
+    if (allUnit) {
+        free(newWt);
+        newWt = NULL;
+    }
+    G->edgeListPtrs = newPtr;
+    G->edgeList = newInd;
+    G->edgeWeights = newWt;
+    G->numEdges = selfLoops + (numAdj - selfLoops)/2; // Self-loops are stored once
+} // End of mergeDuplicateEdges
+
+// function : writeBinaryGraph
+// Write G in the native binary format (file type 7); origIds (may be NULL) and
+// source (NULL unless writing a cache) are stored with it
+bool writeBinaryGraph(graph* G, const long* origIds, const sourceKey* source,
+                      const char* filename) {
+    long NV = G->numVertices;
+    long numAdj = G->edgeListPtrs[NV];
+    binaryGraphHeader header;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, "CGRAPHB");
+    header.version = BINARY_GRAPH_VERSION;
+    header.idWidth = sizeof(vertexId);
+    header.weightWidth = sizeof(edgeWeight);
+    int weighted = 0;
+    if (G->edgeWeights != NULL) {
+        #pragma omp parallel for reduction(||:weighted)
+        for (long i = 0; i < numAdj; i++) {
+            weighted = weighted || (G->edgeWeights[i] != 1);
         }
+    }
+    header.weighted = weighted;
+    header.hasVertexWeights = (G->vertexWeights != NULL);
+    header.hasOrigIds = (origIds != NULL);
+    header.numVertices = NV;
+    header.numEdges = G->numEdges;
+    header.numAdjacencies = numAdj;
+    if (source != NULL) {
+        header.source = *source;
+    }
 
-        // Read rest of the file
-        long PtrPos=0, IndPos=0, cumulative=0;
-        mVerPtr[PtrPos]=cumulative;
-        PtrPos++;
-        switch(value) {
-            case 0 : // No weights
-#ifdef DEBUG
-                printf("Input graph has no weights\n");
-#endif
-                for (i=0; i<mNVer; i++) {
-                    if(feof(fin)) {
-                        fprintf(stderr, "Within function loadMetisFileFormat\n");
-                        fprintf(stderr, "Error reading the metis input file\n");
-                        fprintf(stderr, "Reached abrupt end\n");
-                        // check this! again
-                        return false;
-                    }
-                    j=0;
-                    //getline(&oneLine, &len, fin);
-                    fgets(oneLine, maxLineLen, fin);
-#ifdef DEBUG
-                    printf("oneLine : %s\n", oneLine);
-#endif
-                    remove_newline_ch(oneLine);
-                    trimTrailing(oneLine);
-                    if (strlen(oneLine) == 0) {
-                        fgets(oneLine, maxLineLen, fin);
-                        remove_newline_ch(oneLine);
-                        trimTrailing(oneLine);
+    FILE* out = fopen(filename, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open file %s for writing\n", filename);
+        return false;
+    }
+    char padding[8] = {0};
+    size_t idPad = binaryPadded(numAdj*sizeof(vertexId)) - numAdj*sizeof(vertexId);
+    size_t weightPad = binaryPadded(numAdj*sizeof(edgeWeight)) - numAdj*sizeof(edgeWeight);
+    bool ok = (fwrite(&header, sizeof(header), 1, out) == 1)
+        && (fwrite(G->edgeListPtrs, sizeof(long), NV+1, out) == (size_t)(NV+1))
+        && (fwrite(G->edgeList, sizeof(vertexId), numAdj, out) == (size_t)numAdj)
+        && (fwrite(padding, 1, idPad, out) == idPad)
+        && (!weighted || ((fwrite(G->edgeWeights, sizeof(edgeWeight), numAdj, out) == (size_t)numAdj)
+                          && (fwrite(padding, 1, weightPad, out) == weightPad)))
+        && (!header.hasVertexWeights || (fwrite(G->vertexWeights, sizeof(long), NV, out) == (size_t)NV))
+        && (!header.hasOrigIds || (fwrite(origIds, sizeof(long), NV, out) == (size_t)NV));
+    ok = (fclose(out) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "Error writing binary graph file %s\n", filename);
+    }
+    return ok;
+} // End of writeBinaryGraph
+
+// function : validBinaryCSR
+// Check the mapped arrays before trusting them: pointers start at 0 and never
+// decrease, and every neighbor is a vertex of the graph
+bool validBinaryCSR(const long* ptrs, const vertexId* ids, long NV, long numAdj) {
+    if ((ptrs[0] != 0) || (ptrs[NV] != numAdj)) {
+        return false;
+    }
+    long bad = 0;
+    #pragma omp parallel for reduction(+:bad)
+    for (long v = 0; v < NV; v++) {
+        if (ptrs[v] > ptrs[v+1]) {
+            bad++;
+        }
+    }
+    if (bad > 0) {
+        return false;
+    }
+    #pragma omp parallel for reduction(+:bad)
+    for (long j = 0; j < numAdj; j++) {
+        if ((ids[j] < 0) || ((long)ids[j] >= NV)) {
+            bad++;
+        }
+    }
+    return (bad == 0);
+} // End of validBinaryCSR
+
+// function : loadBinaryGraph
+// Map a file in the native binary format (file type 7) and point G at it.
+// Original vertex ids, if stored, are copied to *origIds. With expect != NULL
+// the file is a cache: it is accepted only if it was written for exactly that
+// input, and a missing or stale cache fails quietly so the caller can rebuild it.
+bool loadBinaryGraph(graph* G, const char* filename, long** origIds,
+                     const sourceKey* expect) {
+#ifdef DETAILED
+    printf("Inside loadBinaryGraph\n");
+#endif
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        if (expect == NULL) {
+            fprintf(stderr, "Cannot open file %s\n", filename);
+        }
+        return false;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(binaryGraphHeader))) {
+        fprintf(stderr, "File %s is too small to be a binary graph\n", filename);
+        close(fd);
+        return false;
+    }
+    // Private writable mapping: pages are shared with the page cache until written
+    void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Cannot map file %s\n", filename);
+        return false;
+    }
+    binaryGraphHeader* header = (binaryGraphHeader*)base;
+    long NV = header->numVertices;
+    long numAdj = header->numAdjacencies;
+    const char* problem = NULL;
+    if (strncmp(header->magic, "CGRAPHB", 8) != 0) {
+        problem = "not a binary graph file";
+    } else if (header->version != BINARY_GRAPH_VERSION) {
+        problem = "unsupported format version (convert the input again with -b)";
+    } else if (header->idWidth != sizeof(vertexId)) {
+        problem = "vertex id width does not match this build";
+    } else if (header->weightWidth != sizeof(edgeWeight)) {
+        problem = "edge weight width does not match this build";
+    } else if ((NV < 0) || (numAdj < 0) ||
+            ((size_t)st.st_size != sizeof(binaryGraphHeader)
+             + (NV+1)*sizeof(long)
+             + binaryPadded(numAdj*sizeof(vertexId))
+             + (header->weighted ? binaryPadded(numAdj*sizeof(edgeWeight)) : 0)
+             + (header->hasVertexWeights ? NV*sizeof(long) : 0)
+             + (header->hasOrigIds ? NV*sizeof(long) : 0))) {
+        problem = "file size does not match the header";
+    }
+    if ((expect != NULL) &&
+        ((problem != NULL) || (memcmp(&header->source, expect, sizeof(sourceKey)) != 0))) {
+        printf("Cache %s is stale; rebuilding it\n", filename);
+        munmap(base, st.st_size);
+        return false;
+    }
+    char* next = (char*)(header + 1);
+    long* ptrs = (long*)next;
+    next += (NV+1)*sizeof(long);
+    vertexId* ids = (vertexId*)next;
+    next += binaryPadded(numAdj*sizeof(vertexId));
+    if ((problem == NULL) && !validBinaryCSR(ptrs, ids, NV, numAdj)) {
+        problem = "corrupt vertex pointers or neighbor ids";
+    }
+    if (problem != NULL) {
+        fprintf(stderr, "Cannot load %s: %s\n", filename, problem);
+        munmap(base, st.st_size);
+        return false;
+    }
+
+    G->numVertices = NV;
+    G->sVertices = NV;
+    G->numEdges = header->numEdges;
+    G->edgeListPtrs = ptrs;
+    G->edgeList = ids;
+    G->edgeWeights = NULL;
+    if (header->weighted) {
+        G->edgeWeights = (edgeWeight*)next;
+        next += binaryPadded(numAdj*sizeof(edgeWeight));
+    }
+    // These small arrays are released with free(), so they are copied out
+    G->vertexWeights = NULL;
+    if (header->hasVertexWeights) {
+        G->vertexWeights = (long*)malloc(NV*sizeof(long));
+        assert(G->vertexWeights != 0);
+        memcpy(G->vertexWeights, next, NV*sizeof(long));
+        next += NV*sizeof(long);
+    }
+    if (header->hasOrigIds) {
+        *origIds = (long*)malloc(NV*sizeof(long));
+        assert(*origIds != 0);
+        memcpy(*origIds, next, NV*sizeof(long));
+    }
+    G->mapBase = base;
+    G->mapSize = st.st_size;
+    return true;
+} // End of loadBinaryGraph
+
+#define SPILL_BLOCK (1L << 20) // Adjacencies buffered per thread before a write
+
+// struct : spillFile
+// Binary graph file (file type 7) being filled by the out-of-core loader
+typedef struct spillFile {
+    int fd;
+    char *name;
+    long numVertices;
+    long numAdjacencies;
+    off_t idOffset; /* start of edgeList in the file */
+    off_t weightOffset; /* start of edgeWeights in the file */
+} spillFile;
+
+// function : pwriteAll
+// pwrite() the whole buffer at offset, retrying after partial writes
+bool pwriteAll(int fd, const void* buf, size_t n, off_t offset) {
+    const char* p = (const char*)buf;
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, offset);
+        if (w <= 0) {
+            return false;
+        }
+        p += w;
+        offset += w;
+        n -= w;
+    }
+    return true;
+} // End of pwriteAll
+
+// function : spillOpen
+// Create a spill file in dir and store the vertex pointers in it
+bool spillOpen(spillFile* S, const char* dir, const long* ptrs, long NV) {
+    S->name = (char*)malloc(strlen(dir) + 64);
+    assert(S->name != 0);
+    sprintf(S->name, "%s/cgraph-spill-%ld.cgb", dir, (long)getpid());
+    S->fd = open(S->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (S->fd < 0) {
+        fprintf(stderr, "Cannot create spill file %s\n", S->name);
+        free(S->name);
+        return false;
+    }
+    S->numVertices = NV;
+    S->numAdjacencies = ptrs[NV];
+    S->idOffset = sizeof(binaryGraphHeader) + (NV+1)*sizeof(long);
+    S->weightOffset = S->idOffset + binaryPadded(ptrs[NV]*sizeof(vertexId));
+    // The header is written last, so an interrupted spill is never a valid graph
+    if (!pwriteAll(S->fd, ptrs, (NV+1)*sizeof(long), sizeof(binaryGraphHeader))) {
+        fprintf(stderr, "Cannot write spill file %s\n", S->name);
+        close(S->fd);
+        unlink(S->name);
+        free(S->name);
+        return false;
+    }
+    return true;
+} // End of spillOpen
+
+// function : spillWrite
+// Store count adjacencies (and their weights, if wts != NULL) from position base on
+bool spillWrite(spillFile* S, const vertexId* ids, const edgeWeight* wts, long base, long count) {
+    return pwriteAll(S->fd, ids, count*sizeof(vertexId), S->idOffset + base*sizeof(vertexId))
+        && ((wts == NULL) ||
+            pwriteAll(S->fd, wts, count*sizeof(edgeWeight), S->weightOffset + base*sizeof(edgeWeight)));
+} // End of spillWrite
+
+// function : spillFinish
+// Append the vertex weights (if any), cut the file to the layout of a graph
+// with or without edge weights, write the header and close the file
+bool spillFinish(spillFile* S, long numEdges, bool weighted, const long* vertexWeights) {
+    long NV = S->numVertices;
+    off_t end = S->weightOffset;
+    if (weighted) {
+        end += binaryPadded(S->numAdjacencies*sizeof(edgeWeight));
+    }
+    bool ok = true;
+    if (vertexWeights != NULL) {
+        ok = pwriteAll(S->fd, vertexWeights, NV*sizeof(long), end);
+        end += NV*sizeof(long);
+    }
+    binaryGraphHeader header;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, "CGRAPHB");
+    header.version = BINARY_GRAPH_VERSION;
+    header.idWidth = sizeof(vertexId);
+    header.weighted = weighted;
+    header.weightWidth = sizeof(edgeWeight);
+    header.hasVertexWeights = (vertexWeights != NULL);
+    header.numVertices = NV;
+    header.numEdges = numEdges;
+    header.numAdjacencies = S->numAdjacencies;
+    ok = ok && (ftruncate(S->fd, end) == 0)
+        && pwriteAll(S->fd, &header, sizeof(header), 0);
+    ok = (close(S->fd) == 0) && ok;
+    return ok;
+} // End of spillFinish
+
+// function : skipMetisPrefix
+// Skip the numPrefix numbers (vertex size and/or vertex weights) that open
+// a vertex line of a weighted METIS file. The first vertex weight is stored
+// in *vwgt when wgtIndex >= 0 says where it is. Returns the position of the
+// first neighbor, or NULL if the line is too short.
+static inline const char* skipMetisPrefix(const char* t, const char* e, int numPrefix,
+        int wgtIndex, long* vwgt) {
+    for (int k = 0; k < numPrefix; k++) {
+        long number;
+        const char* u = scanLong(t, e, &number);
+        if (u == t) {
+            return NULL;
+        }
+        if (k == wgtIndex) {
+            *vwgt = number;
+        }
+        t = skipBlanks(u, e);
+    }
+    return t;
+}
+
+// function : loadMetisFileFormat
+// parse file in metis format
+// The fmt field of the header is handled in full: edge weights (fmt xx1)
+// follow every neighbor, and each vertex line may open with a vertex size
+// (fmt 1xx, skipped) and ncon vertex weights (fmt x1x). The first vertex
+// weight is kept in vertexWeights; modularity itself has no vertex weight
+// term. Edge weights that are all 1 are dropped (unit weight path).
+// The file is mapped into memory and split into one chunk of lines per
+// thread. Each chunk is scanned twice: once to count the neighbors of its
+// vertices, which are prefix-summed into edgeListPtrs, and once to write
+// the neighbors straight into their place in edgeList.
+// With spillDir != NULL (out-of-core mode) the neighbors and weights are not
+// kept in memory: every thread streams its sorted run of adjacencies with
+// pwrite() into a binary graph file in spillDir, which is then mapped as the
+// graph. Only the vertex arrays stay in memory; the file is unlinked at once
+// and its space is released when the graph is freed after the first phase.
+bool loadMetisFileFormat(graph *G, const char* filename, const char* spillDir) {
+#ifdef DETAILED
+    printf("Inside loadMetisFileFormat\n");
+#endif
+    long mNVer = 0, mNEdge = 0, value = 0, ncon = 0;
+    size_t fileSize = 0;
+    double time1 = omp_get_wtime();
+    char* data = mapInputFile(filename, &fileSize);
+    if (data == NULL) {
+        return false;
+    }
+    const char* end = data + fileSize;
+
+    // Ignore comments - line starting with '%'
+    const char* p = data;
+    while ((p < end) && (*p == '%')) {
+        p = nextLine(p, end);
+    }
+    // Header : #vertices #edges [fmt [ncon]]
+    const char* q = scanLong(skipBlanks(p, end), end, &mNVer);
+    q = scanLong(skipBlanks(q, end), end, &mNEdge);
+    q = scanLong(skipBlanks(q, end), end, &value);
+    scanLong(skipBlanks(q, end), end, &ncon);
+    bool hasEdgeWeights = (value % 10) == 1;
+    bool hasVertexWeights = (value / 10 % 10) == 1;
+    bool hasVertexSizes = (value / 100) == 1;
+    if (hasVertexWeights && (ncon == 0)) {
+        ncon = 1;
+    }
+    if ((mNVer <= 0) || (mNEdge < 0) || (ncon < 0) || (value < 0) || (value > 111) || ((value % 10) > 1)
+            || ((value / 10 % 10) > 1)) {
+        fprintf(stderr, "Within function loadMetisFileFormat\n");
+        fprintf(stderr, "Invalid header in the metis input file %s\n", filename);
+        munmap(data, fileSize);
+        return false;
+    }
+    if (mNVer > VERTEX_ID_MAX) {
+        fprintf(stderr, "Within function loadMetisFileFormat\n");
+        fprintf(stderr, "%ld vertices do not fit the vertex ids of this build (%d bytes)\n", mNVer, (int)sizeof(vertexId));
+        munmap(data, fileSize);
+        return false;
+    }
+    int numPrefix = (hasVertexSizes ? 1 : 0) + (hasVertexWeights ? (int)ncon : 0);
+    int wgtIndex = hasVertexWeights ? (hasVertexSizes ? 1 : 0) : -1;
+    const char* body = nextLine(p, end);
+
+    // Split the vertex lines into one chunk per thread
+    int nChunks = omp_get_max_threads();
+    if ((end - body) < (1L << 20)) {
+        nChunks = 1; // Not worth splitting small files
+    }
+    const char** chunkStart = (const char**)malloc((nChunks+1) * sizeof(char*));
+    long* chunkVertex = (long*)malloc((nChunks+1) * sizeof(long));
+    assert((chunkStart != 0) && (chunkVertex != 0));
+    splitAtNewlines(body, end, nChunks, chunkStart);
+
+    // Step 1 : count the vertex lines of every chunk
+    chunkVertex[0] = 0;
+    #pragma omp parallel for schedule(static, 1)
+    for (int c = 0; c < nChunks; c++) {
+        long lines = 0;
+        for (const char* s = chunkStart[c]; s < chunkStart[c+1]; s = nextLine(s, end)) {
+            if (*s != '%') { // Comments are not vertices
+                lines++;
+            }
+        }
+        chunkVertex[c+1] = lines;
+    }
+    for (int c = 0; c < nChunks; c++) {
+        chunkVertex[c+1] += chunkVertex[c];
+    }
+    if (chunkVertex[nChunks] < mNVer) {
+        fprintf(stderr, "Within function loadMetisFileFormat\n");
+        fprintf(stderr, "Error reading the metis input file\n");
+        fprintf(stderr, "Reached abrupt end: %ld of %ld vertices\n", chunkVertex[nChunks], mNVer);
+        munmap(data, fileSize);
+        free(chunkStart);
+        free(chunkVertex);
+        return false;
+    }
+
+    // Store vertex degree
+    long* mVerPtr = (long*)malloc((mNVer+1)*sizeof(long));
+    assert(mVerPtr != 0);
+    mVerPtr[0] = 0;
+    long* mVerWgt = NULL;
+    if (hasVertexWeights) {
+        mVerWgt = (long*)malloc(mNVer*sizeof(long));
+        assert(mVerWgt != 0);
+    }
+
+    // Step 2 : count the neighbors of every vertex
+    bool parseError = false;
+    #pragma omp parallel for schedule(static, 1)
+    for (int c = 0; c < nChunks; c++) {
+        long v = chunkVertex[c];
+        for (const char* s = chunkStart[c]; s < chunkStart[c+1]; s = nextLine(s, end)) {
+            if (*s == '%') {
+                continue;
+            }
+            const char* e = nextLine(s, end);
+            long degree = 0, neighbor, vwgt = 1;
+            const char* t = skipBlanks(s, e);
+            if (numPrefix > 0) {
+                t = skipMetisPrefix(t, e, numPrefix, wgtIndex, &vwgt);
+                if (t == NULL) {
+                    if (v < mNVer) {
+                        parseError = true;
                     }
-                    char* oneLineMod = (char*)malloc(maxLineLen+1);
-                    memset(oneLineMod, '\0', sizeof(oneLineMod));
-                    if (oneLineMod) {
-                        strcpy(oneLineMod, oneLine);
+                    v++;
+                    continue;
+                }
+                if (mVerWgt != NULL && v < mNVer) {
+                    mVerWgt[v] = vwgt;
+                }
+            }
+            while ((t < e) && (*t != '\n')) {
+                const char* u = scanLong(t, e, &neighbor);
+                if ((u == t) || (neighbor < 1) || (neighbor > mNVer)) {
+                    if (v < mNVer) {
+                        parseError = true;
                     }
-#ifdef DEBUG
-                    printf("oneLine : %s\n", oneLine);
-                    printf("oneLineMod : %s\n", oneLineMod);
+                    break;
+                }
+                if (hasEdgeWeights) { // Every neighbor is followed by its edge weight
+                    double weight;
+                    const char* w = skipBlanks(u, e);
+                    u = scanDouble(w, e, &weight);
+                    if (u == w) {
+                        if (v < mNVer) {
+                            parseError = true;
+                        }
+                        break;
+                    }
+                }
+                degree++;
+                t = skipBlanks(u, e);
+            }
+            if (v < mNVer) {
+                mVerPtr[v+1] = degree;
+            } else if (degree > 0) {
+                parseError = true; // More vertex lines than the header says
+            }
+            v++;
+        }
+    }
+    if (parseError) {
+        fprintf(stderr, "Within function loadMetisFileFormat\n");
+        fprintf(stderr, "Invalid neighbor list in the metis input file %s\n", filename);
+        munmap(data, fileSize);
+        free(chunkStart);
+        free(chunkVertex);
+        free(mVerPtr);
+        free(mVerWgt);
+        return false;
+    }
+    parallelPrefixSum(mVerPtr+1, mNVer);
+    long numAdj = mVerPtr[mNVer];
+    if (numAdj != 2*mNEdge) {
+        fprintf(stderr, "Warning: metis header has %ld edges but the file lists %ld adjacencies\n", mNEdge, numAdj);
+    }
+
+    // Store edge information
+    // Unweighted format: no weight array is stored
+    vertexId* mEdgeList = NULL;
+    edgeWeight* mEdgeWeights = NULL;
+    spillFile spill;
+    if (spillDir != NULL) {
+        if (!spillOpen(&spill, spillDir, mVerPtr, mNVer)) {
+            munmap(data, fileSize);
+            free(chunkStart);
+            free(chunkVertex);
+            free(mVerPtr);
+            free(mVerWgt);
+            return false;
+        }
+    } else {
+        mEdgeList = (vertexId*)malloc(numAdj*sizeof(vertexId));
+        assert(mEdgeList != 0);
+        if (hasEdgeWeights) {
+            mEdgeWeights = (edgeWeight*)malloc(numAdj*sizeof(edgeWeight));
+            assert(mEdgeWeights != 0);
+        }
+    }
+    int allUnit = 1;
+
+    // Step 3 : write the neighbors of every vertex into place
+    // (out-of-core: into a per-thread buffer flushed to the spill file)
+    bool spillError = false;
+    #pragma omp parallel for schedule(static, 1) reduction(&&:allUnit)
+    for (int c = 0; c < nChunks; c++) {
+        long v = chunkVertex[c];
+        vertexId* ids = mEdgeList;
+        edgeWeight* wts = mEdgeWeights;
+        long base = 0, count = 0; // Buffered run: adjacencies base .. base+count-1
+        if (spillDir != NULL) {
+            ids = (vertexId*)malloc(SPILL_BLOCK*sizeof(vertexId));
+            wts = (edgeWeight*)malloc(SPILL_BLOCK*sizeof(edgeWeight));
+            assert((ids != 0) && (wts != 0));
+            base = (v < mNVer) ? mVerPtr[v] : numAdj;
+        }
+        for (const char* s = chunkStart[c]; (s < chunkStart[c+1]) && (v < mNVer); s = nextLine(s, end)) {
+            if (*s == '%') {
+                continue;
+            }
+            const char* e = nextLine(s, end);
+            long IndPos = mVerPtr[v] - base, neighbor, vwgt;
+            const char* t = skipBlanks(s, e);
+            if (numPrefix > 0) {
+                t = skipMetisPrefix(t, e, numPrefix, -1, &vwgt);
+            }
+            while ((t < e) && (*t != '\n')) {
+                if ((spillDir != NULL) && (IndPos == SPILL_BLOCK)) {
+                    if (!spillWrite(&spill, ids, hasEdgeWeights ? wts : NULL, base, SPILL_BLOCK)) {
+                        spillError = true;
+                    }
+                    base += SPILL_BLOCK;
+                    IndPos = 0;
+                }
+                t = scanLong(t, e, &neighbor);
+                ids[IndPos] = neighbor - 1; // Zero-based Index
+                if (hasEdgeWeights) {
+                    double weight = 1;
+                    t = scanDouble(skipBlanks(t, e), e, &weight);
+                    wts[IndPos] = weight;
+                    allUnit = allUnit && (weight == 1);
+                }
+                IndPos++;
+                t = skipBlanks(t, e);
+            }
+            count = IndPos;
+            v++;
+        }
+        if (spillDir != NULL) {
+            if ((count > 0) && !spillWrite(&spill, ids, hasEdgeWeights ? wts : NULL, base, count)) {
+                spillError = true;
+            }
+            free(ids);
+            free(wts);
+        }
+    }
+
+    munmap(data, fileSize);
+    free(chunkStart);
+    free(chunkVertex);
+    if (spillDir != NULL) {
+        // The vertex arrays move to the file as well; G then maps it
+        bool ok = !spillError && spillFinish(&spill, mNEdge, hasEdgeWeights && !allUnit, mVerWgt);
+        free(mVerPtr);
+        free(mVerWgt);
+        ok = ok && loadBinaryGraph(G, spill.name, NULL, NULL);
+        unlink(spill.name); // The mapping keeps the data until the graph is freed
+        if (!ok) {
+            fprintf(stderr, "Within function loadMetisFileFormat\n");
+            fprintf(stderr, "Cannot spill the adjacency arrays to %s\n", spillDir);
+        } else {
+            posix_madvise(G->mapBase, G->mapSize, POSIX_MADV_SEQUENTIAL);
+        }
+        free(spill.name);
+#ifdef DETAILED
+        printf("Time to load metis file out of core: %3.3lf\n", omp_get_wtime() - time1);
 #endif
-                    count = countTokens(oneLineMod, myDelimiter);
-#ifdef DEBUG
-                    printf("outside while, count is %ld\n", count);
+        return ok;
+    }
+    if (hasEdgeWeights && allUnit) {
+        free(mEdgeWeights);
+        mEdgeWeights = NULL;
+    }
+#ifdef DETAILED
+    printf("Time to load metis file: %3.3lf\n", omp_get_wtime() - time1);
 #endif
-                    while (count) {
-#ifdef DEBUG
-                        printf("count is %ld\n", count);
+
+    // Populate the graph structure
+    G->numVertices = mNVer;
+    G->sVertices = mNVer;
+    G->numEdges = mNEdge;
+    G->edgeListPtrs = mVerPtr;
+    G->edgeList = mEdgeList;
+    G->edgeWeights = mEdgeWeights;
+    G->vertexWeights = mVerWgt;
+    G->mapBase = NULL;
+    G->mapSize = 0;
+
+    return true;
+} // End 
+
+// function : loadMatrixMarketFile
+// Matrix Market coordinate files (file type 1): pattern, real or integer
+// values, general or symmetric. The matrix is read as an undirected graph
+// on max(rows, columns) vertices: every entry (i, j, value) is one edge,
+// which buildGraphFromEdgeList stores in both rows. A symmetric file lists
+// each edge once, so it is expanded there without a second pass; a general
+// file gives the graph of (A + A^T)/2: off-diagonal entries count half in
+// each row and the repeated adjacencies are merged, so a symmetric matrix
+// stored as general yields the same CSR. Values that are all 1 are dropped.
+bool loadMatrixMarketFile(graph *G, const char* filename) {
+#ifdef DETAILED
+    printf("Inside loadMatrixMarketFile\n");
 #endif
-                        neighbor = getNextToken(oneLine, oneLineMod, myDelimiter) - 1; // Zero-based Index
-#ifdef DEBUG
-                        printf("oneLineMode : %s\n", oneLineMod);
-                        printf("neighbor is %ld\n", neighbor);
+    size_t fileSize = 0;
+    double time1 = omp_get_wtime();
+    char* data = mapInputFile(filename, &fileSize);
+    if (data == NULL) {
+        return false;
+    }
+    const char* end = data + fileSize;
+
+    // Banner : %%MatrixMarket matrix coordinate <field> <symmetry>
+    char word[5][32];
+    const char* p = data;
+    for (int w = 0; w < 5; w++) {
+        p = scanWord(skipBlanks(p, end), end, word[w], 32);
+    }
+    bool pattern = (strcmp(word[3], "pattern") == 0);
+    if ((strcmp(word[0], "%%matrixmarket") != 0) || (strcmp(word[1], "matrix") != 0)) {
+        fprintf(stderr, "Within function loadMatrixMarketFile\n");
+        fprintf(stderr, "%s is not a Matrix Market file\n", filename);
+        munmap(data, fileSize);
+        return false;
+    }
+    if ((strcmp(word[2], "coordinate") != 0) || (!pattern && (strcmp(word[3], "real") != 0)
+                && (strcmp(word[3], "integer") != 0)) || ((strcmp(word[4], "general") != 0)
+                && (strcmp(word[4], "symmetric") != 0))) {
+        fprintf(stderr, "Within function loadMatrixMarketFile\n");
+        fprintf(stderr, "Matrix Market format '%s %s %s' is not supported\n", word[2], word[3], word[4]);
+        munmap(data, fileSize);
+        return false;
+    }
+
+    // Size line : #rows #columns #entries, after the comments
+    p = nextLine(p, end);
+    while (p < end) {
+        const char* t = skipBlanks(p, end);
+        if ((*p != '%') && (t < end) && (*t != '\n')) {
+            break;
+        }
+        p = nextLine(p, end); // Comment or blank line (possibly the last, unterminated)
+    }
+    long numRows = 0, numCols = 0, numEntries = -1;
+    const char* q = scanLong(skipBlanks(p, end), end, &numRows);
+    q = scanLong(skipBlanks(q, end), end, &numCols);
+    scanLong(skipBlanks(q, end), end, &numEntries);
+    long NV = (numRows > numCols) ? numRows : numCols;
+    if ((numRows <= 0) || (numCols <= 0) || (numEntries < 0)) {
+        fprintf(stderr, "Within function loadMatrixMarketFile\n");
+        fprintf(stderr, "Invalid size line in the Matrix Market file %s\n", filename);
+        munmap(data, fileSize);
+        return false;
+    }
+    if (NV > VERTEX_ID_MAX) {
+        fprintf(stderr, "Within function loadMatrixMarketFile\n");
+        fprintf(stderr, "%ld vertices do not fit the vertex ids of this build (%d bytes)\n", NV, (int)sizeof(vertexId));
+        munmap(data, fileSize);
+        return false;
+    }
+    const char* body = nextLine(p, end);
+
+    // Entries : row column [value]
+    long *rows = NULL, *cols = NULL;
+    double* values = NULL;
+    bool allUnit = true;
+    long numRead = readEdgeLines(body, end, "%", &rows, &cols, pattern ? NULL : &values, &allUnit);
+    munmap(data, fileSize);
+    if (numRead != numEntries) {
+        fprintf(stderr, "Within function loadMatrixMarketFile\n");
+        if (numRead < 0) {
+            fprintf(stderr, "Invalid entry in the Matrix Market file %s\n", filename);
+        } else {
+            fprintf(stderr, "The size line announces %ld entries but the file lists %ld\n", numEntries, numRead);
+            free(rows);
+            free(cols);
+            free(values);
+        }
+        return false;
+    }
+
+    // Zero-based ids and, unless all values are 1, the weights
+    vertexId *src, *dst;
+    edgeWeight* wt;
+    if (allUnit) {
+        free(values);
+        values = NULL;
+    }
+    if (!convertEdgeRecords(numEntries, rows, cols, values, 1, numRows, numCols, &src, &dst, &wt)) {
+        fprintf(stderr, "Within function loadMatrixMarketFile\n");
+        fprintf(stderr, "Entry out of range in the Matrix Market file %s\n", filename);
+        return false;
+    }
+
+    // A general file lists (i, j) and (j, i) apart: halve the off-diagonal values
+    bool general = (strcmp(word[4], "general") == 0);
+    if (general) {
+        if (wt == NULL) {
+            wt = (edgeWeight*)malloc(numEntries * sizeof(edgeWeight));
+            assert(wt != 0);
+            #pragma omp parallel for
+            for (long k = 0; k < numEntries; k++) {
+                wt[k] = 1;
+            }
+        }
+        #pragma omp parallel for
+        for (long k = 0; k < numEntries; k++) {
+            if (src[k] != dst[k]) {
+                wt[k] = wt[k] / 2;
+            }
+        }
+    }
+
+    // Bucket the entries by row into the symmetric CSR
+    buildGraphFromEdgeList(G, NV, numEntries, src, dst, wt, false);
+    free(src);
+    free(dst);
+    free(wt);
+    if (general) {
+        mergeDuplicateEdges(G); // One adjacency per pair, weights summed
+    }
+#ifdef DETAILED
+    printf("Time to load Matrix Market file: %3.3lf\n", omp_get_wtime() - time1);
 #endif
-                        j++;
-                        mEdgeList[IndPos].head = i;
-                        mEdgeList[IndPos].tail = neighbor;
-                        mEdgeList[IndPos].weight = 1;
-                        IndPos++;
-                        count = countTokens(oneLineMod, myDelimiter);
-#ifdef DEBUG
-                        printf("value of count is %ld\n", count);
+    return true;
+} // End of loadMatrixMarketFile
+
+// function : loadSnapFile
+// SNAP edge lists (file type 8): one "u v" pair per line, '#' comments,
+// arbitrary non-negative 64-bit vertex ids, each edge in one or both
+// directions. The original ids are compacted to 0..NV-1 in increasing
+// order through a concurrent open-addressing table, the edges are
+// symmetrized and duplicates are dropped. On success *origIds holds the
+// original id of every vertex (to be freed by the caller).
+bool loadSnapFile(graph *G, const char* filename, long** origIds) {
+#ifdef DETAILED
+    printf("Inside loadSnapFile\n");
 #endif
-                    }
-#ifdef DEBUG
-                    printf("value of i is %ld\n", i);
+    size_t fileSize = 0;
+    double time1 = omp_get_wtime();
+    char* data = mapInputFile(filename, &fileSize);
+    if (data == NULL) {
+        return false;
+    }
+    const char* end = data + fileSize;
+
+    // Step 1 : parse the original ids of both endpoints
+    long *rawSrc = NULL, *rawDst = NULL;
+    long numEntries = readEdgeLines(data, end, "#%", &rawSrc, &rawDst, NULL, NULL);
+    munmap(data, fileSize);
+    bool negativeId = false;
+    #pragma omp parallel for reduction(||:negativeId)
+    for (long k = 0; k < numEntries; k++) {
+        negativeId = negativeId || (rawSrc[k] < 0) || (rawDst[k] < 0);
+    }
+    if ((numEntries <= 0) || negativeId) {
+        fprintf(stderr, "Within function loadSnapFile\n");
+        fprintf(stderr, "%s in the SNAP file %s\n", (numEntries == 0) ? "No edges" : "Invalid edge line", filename);
+        free(rawSrc);
+        free(rawDst);
+        return false;
+    }
+
+    // Step 2 : insert every original id into the table, then collect the distinct ids
+    long tableSize = 2;
+    while (tableSize < 4*numEntries) { // At most 2*numEntries ids, load factor <= 1/2
+        tableSize <<= 1;
+    }
+    int shift = 64;
+    for (long t = tableSize; t > 1; t >>= 1) {
+        shift--;
+    }
+    long mask = tableSize - 1;
+    long* tableKey = (long*)malloc(tableSize * sizeof(long));
+    long* tableVal = (long*)malloc((tableSize+1) * sizeof(long));
+    assert((tableKey != 0) && (tableVal != 0));
+    #pragma omp parallel for
+    for (long h = 0; h < tableSize; h++) {
+        tableKey[h] = -1;
+    }
+    #pragma omp parallel for
+    for (long k = 0; k < 2*numEntries; k++) {
+        long id = (k < numEntries) ? rawSrc[k] : rawDst[k - numEntries];
+        long h = (long)(((unsigned long)id * 0x9E3779B97F4A7C15UL) >> shift);
+        while (true) {
+            long old = __sync_val_compare_and_swap(&tableKey[h], -1, id);
+            if ((old == -1) || (old == id)) {
+                break;
+            }
+            h = (h + 1) & mask; // Linear probing
+        }
+    }
+    tableVal[0] = 0;
+    #pragma omp parallel for
+    for (long h = 0; h < tableSize; h++) {
+        tableVal[h+1] = (tableKey[h] != -1);
+    }
+    parallelPrefixSum(tableVal+1, tableSize);
+    long NV = tableVal[tableSize];
+    if (NV > VERTEX_ID_MAX) {
+        fprintf(stderr, "Within function loadSnapFile\n");
+        fprintf(stderr, "%ld vertices do not fit the vertex ids of this build (%d bytes)\n", NV, (int)sizeof(vertexId));
+        free(rawSrc);
+        free(rawDst);
+        free(tableKey);
+        free(tableVal);
+        return false;
+    }
+    long* ids = (long*)malloc(NV * sizeof(long));
+    assert(ids != 0);
+    #pragma omp parallel for
+    for (long h = 0; h < tableSize; h++) {
+        if (tableKey[h] != -1) {
+            ids[tableVal[h]] = tableKey[h];
+        }
+    }
+
+    // Step 3 : dense ids follow the order of the original ids
+    parallelSortLongs(ids, NV);
+    #pragma omp parallel for
+    for (long r = 0; r < NV; r++) {
+        long h = (long)(((unsigned long)ids[r] * 0x9E3779B97F4A7C15UL) >> shift);
+        while (tableKey[h] != ids[r]) {
+            h = (h + 1) & mask;
+        }
+        tableVal[h] = r;
+    }
+    vertexId* src = (vertexId*)malloc(numEntries * sizeof(vertexId));
+    vertexId* dst = (vertexId*)malloc(numEntries * sizeof(vertexId));
+    assert((src != 0) && (dst != 0));
+    #pragma omp parallel for
+    for (long k = 0; k < 2*numEntries; k++) {
+        long id = (k < numEntries) ? rawSrc[k] : rawDst[k - numEntries];
+        long h = (long)(((unsigned long)id * 0x9E3779B97F4A7C15UL) >> shift);
+        while (tableKey[h] != id) {
+            h = (h + 1) & mask;
+        }
+        if (k < numEntries) {
+            src[k] = tableVal[h];
+        } else {
+            dst[k - numEntries] = tableVal[h];
+        }
+    }
+    free(rawSrc);
+    free(rawDst);
+    free(tableKey);
+    free(tableVal);
+
+    // Step 4 : symmetric CSR without repeated edges
+    buildGraphFromEdgeList(G, NV, numEntries, src, dst, NULL, false);
+    free(src);
+    free(dst);
+    removeDuplicateEdges(G);
+    *origIds = ids;
+#ifdef DETAILED
+    printf("Time to load SNAP file: %3.3lf\n", omp_get_wtime() - time1);
 #endif
-                    if (oneLineMod) {
-                        free(oneLineMod);
-                    }
-                    cumulative += j;
-                    mVerPtr[PtrPos] = cumulative;
-                    PtrPos++;
+    return true;
+} // End of loadSnapFile
+
+// function : loadPajekFile
+// Pajek .net files (file types 3 and 4): header lines such as "*Network",
+// a "*Vertices n" line, n vertex lines (ignored), then "*Edges" or "*Arcs"
+// sections of "u v [w]" records with 1-based ids; any other section after
+// *Vertices is rejected. With twice (file type 4) every edge is listed from
+// both ends, otherwise once. Weights that are all 1 are dropped.
+bool loadPajekFile(graph *G, const char* filename, bool twice) {
+#ifdef DETAILED
+    printf("Inside loadPajekFile\n");
+#endif
+    size_t fileSize = 0;
+    double time1 = omp_get_wtime();
+    char* data = mapInputFile(filename, &fileSize);
+    if (data == NULL) {
+        return false;
+    }
+    const char* end = data + fileSize;
+
+    // Find "*Vertices n", then skip the vertex lines up to the first edge section
+    char word[32];
+    long NV = -1;
+    const char* p = data;
+    const char* body = NULL;
+    for (; (p < end) && (body == NULL); p = nextLine(p, end)) {
+        const char* t = skipBlanks(p, end);
+        if ((t == end) || (*t != '*')) {
+            continue;
+        }
+        const char* q = scanWord(t, end, word, 32);
+        if (strcmp(word, "*vertices") == 0) {
+            scanLong(skipBlanks(q, end), end, &NV);
+        } else if ((strcmp(word, "*edges") == 0) || (strcmp(word, "*arcs") == 0)) {
+            body = nextLine(p, end);
+        } else if (NV > 0) {
+            break; // Edge lists, matrices or other sections
+        } // Else a header line before *Vertices, e.g. "*Network name"
+    }
+    if ((NV <= 0) || (body == NULL)) {
+        fprintf(stderr, "Within function loadPajekFile\n");
+        fprintf(stderr, "%s in the Pajek file %s\n", (NV <= 0) ? "No valid *Vertices line"
+                : "No *Edges or *Arcs section (other sections are not supported)", filename);
+        munmap(data, fileSize);
+        return false;
+    }
+    if (NV > VERTEX_ID_MAX) {
+        fprintf(stderr, "Within function loadPajekFile\n");
+        fprintf(stderr, "%ld vertices do not fit the vertex ids of this build (%d bytes)\n", NV, (int)sizeof(vertexId));
+        munmap(data, fileSize);
+        return false;
+    }
+
+    // Later sections must hold edges too: reject *Edgeslist, *Matrix and the like
+    for (const char* h = memchr(body, '*', end - body); h != NULL;
+            h = memchr(h + 1, '*', end - h - 1)) {
+        const char* t = h;
+        while ((t > body) && ((t[-1] == ' ') || (t[-1] == '\t'))) {
+            t--;
+        }
+        if ((t > body) && (t[-1] != '\n')) {
+            continue; // Not a header line
+        }
+        scanWord(h, end, word, 32);
+        if ((strcmp(word, "*edges") != 0) && (strcmp(word, "*arcs") != 0)) {
+            fprintf(stderr, "Within function loadPajekFile\n");
+            fprintf(stderr, "Section %s is not supported in the Pajek file %s\n", word, filename);
+            munmap(data, fileSize);
+            return false;
+        }
+    }
+
+    // Records of all the following sections; their '*' header lines are skipped
+    long *first = NULL, *second = NULL;
+    double* values = NULL;
+    bool allUnit = true;
+    long numEntries = readEdgeLines(body, end, "*%", &first, &second, &values, &allUnit);
+    munmap(data, fileSize);
+    if (numEntries < 0) {
+        fprintf(stderr, "Within function loadPajekFile\n");
+        fprintf(stderr, "Invalid edge line in the Pajek file %s\n", filename);
+        return false;
+    }
+    if (allUnit) {
+        free(values);
+        values = NULL;
+    }
+    vertexId *src, *dst;
+    edgeWeight* wt;
+    if (!convertEdgeRecords(numEntries, first, second, values, 1, NV, NV, &src, &dst, &wt)) {
+        fprintf(stderr, "Within function loadPajekFile\n");
+        fprintf(stderr, "Vertex id out of range in the Pajek file %s\n", filename);
+        return false;
+    }
+    buildGraphFromEdgeList(G, NV, numEntries, src, dst, wt, twice);
+    free(src);
+    free(dst);
+    free(wt);
+#ifdef DETAILED
+    printf("Time to load Pajek file: %3.3lf\n", omp_get_wtime() - time1);
+#endif
+    return true;
+} // End of loadPajekFile
+
+// function : loadSimpleEdgeList
+// Plain edge lists (file type 6): one "u v [w]" record per line with
+// 0-based ids, every edge listed from both ends. The graph has as many
+// vertices as the largest id plus one. Lines starting with '#' or '%' are
+// comments, and weights that are all 1 are dropped.
+bool loadSimpleEdgeList(graph *G, const char* filename) {
+#ifdef DETAILED
+    printf("Inside loadSimpleEdgeList\n");
+#endif
+    size_t fileSize = 0;
+    double time1 = omp_get_wtime();
+    char* data = mapInputFile(filename, &fileSize);
+    if (data == NULL) {
+        return false;
+    }
+    long *first = NULL, *second = NULL;
+    double* values = NULL;
+    bool allUnit = true;
+    long numEntries = readEdgeLines(data, data + fileSize, "#%", &first, &second, &values, &allUnit);
+    munmap(data, fileSize);
+    if (numEntries <= 0) {
+        fprintf(stderr, "Within function loadSimpleEdgeList\n");
+        fprintf(stderr, "%s in the edge list %s\n", (numEntries == 0) ? "No edges" : "Invalid edge line", filename);
+        return false;
+    }
+    long maxId = -1;
+    #pragma omp parallel for reduction(max:maxId)
+    for (long k = 0; k < numEntries; k++) {
+        long m = (first[k] > second[k]) ? first[k] : second[k];
+        if (m > maxId) {
+            maxId = m;
+        }
+    }
+    long NV = maxId + 1;
+    if (NV > VERTEX_ID_MAX) {
+        fprintf(stderr, "Within function loadSimpleEdgeList\n");
+        fprintf(stderr, "%ld vertices do not fit the vertex ids of this build (%d bytes)\n", NV, (int)sizeof(vertexId));
+        free(first);
+        free(second);
+        free(values);
+        return false;
+    }
+    if (allUnit) {
+        free(values);
+        values = NULL;
+    }
+    vertexId *src, *dst;
+    edgeWeight* wt;
+    if (!convertEdgeRecords(numEntries, first, second, values, 0, NV, NV, &src, &dst, &wt)) {
+        fprintf(stderr, "Within function loadSimpleEdgeList\n");
+        fprintf(stderr, "Negative vertex id in the edge list %s\n", filename);
+        return false;
+    }
+    buildGraphFromEdgeList(G, NV, numEntries, src, dst, wt, true);
+    free(src);
+    free(dst);
+    free(wt);
+#ifdef DETAILED
+    printf("Time to load edge list: %3.3lf\n", omp_get_wtime() - time1);
+#endif
+    return true;
+} // End of loadSimpleEdgeList
+
+#define HASH_BLOCK (1L << 20)
+
+// function : hashBlock
+// 64-bit hash of a byte range, consuming 8-byte words
+unsigned long hashBlock(const unsigned char* p, size_t n, unsigned long h) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        unsigned long w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x9E3779B97F4A7C15UL;
+        h ^= h >> 29;
+    }
+    for (; i < n; i++) {
+        h = (h ^ p[i]) * 0x100000001B3UL;
+    }
+    return h;
+} // End of hashBlock
+
+// function : readSourceKey
+// Size, modification time and content hash of a file. The hash is taken over
+// fixed 1 MB blocks in parallel, so it does not depend on the number of threads;
+// compressed inputs are hashed as stored.
+bool readSourceKey(const char* filename, int fType, sourceKey* key) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open file %s\n", filename);
+        return false;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+        close(fd);
+        return false;
+    }
+    unsigned char* data = (unsigned char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+    long size = st.st_size;
+    long numBlocks = (size + HASH_BLOCK - 1) / HASH_BLOCK;
+    unsigned long* blockHash = (unsigned long*)malloc(numBlocks*sizeof(unsigned long));
+    assert(blockHash != 0);
+    #pragma omp parallel for schedule(static)
+    for (long b = 0; b < numBlocks; b++) {
+        long begin = b * HASH_BLOCK;
+        long end = (begin + HASH_BLOCK < size) ? begin + HASH_BLOCK : size;
+        blockHash[b] = hashBlock(data + begin, end - begin, 0xCBF29CE484222325UL + b);
+    }
+    munmap(data, st.st_size);
+    unsigned long h = (unsigned long)size;
+    for (long b = 0; b < numBlocks; b++) {
+        h = (h ^ blockHash[b]) * 0x9E3779B97F4A7C15UL;
+        h ^= h >> 31;
+    }
+    free(blockHash);
+
+    memset(key, 0, sizeof(sourceKey));
+    key->type = fType;
+    key->size = size;
+    key->mtime = (long)st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec;
+    key->hash = h;
+    return true;
+} // End of readSourceKey
+
+// function : writeGraphCache
+// Store G as the binary cache of a text input. The file is written under a
+// temporary name and renamed, so concurrent runs never map a partial cache.
+bool writeGraphCache(graph* G, const long* origIds, const sourceKey* source,
+                     const char* cacheFile) {
+    char* tmpFile = (char*)malloc(strlen(cacheFile) + 32);
+    assert(tmpFile != 0);
+    sprintf(tmpFile, "%s.%ld", cacheFile, (long)getpid());
+    bool ok = writeBinaryGraph(G, origIds, source, tmpFile);
+    if (ok && (rename(tmpFile, cacheFile) != 0)) {
+        fprintf(stderr, "Cannot rename %s to %s\n", tmpFile, cacheFile);
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmpFile);
+    }
+    free(tmpFile);
+    return ok;
+} // End of writeGraphCache
+
+// struct : graphCheck
+// Findings of checkGraph
+typedef struct graphCheck {
+    long outOfRange; /* neighbors outside 0 .. numVertices-1 */
+    long selfLoops; /* adjacencies of a vertex to itself */
+    long duplicates; /* repeated neighbors within a row */
+    long unbalanced; /* vertices listed by more (or fewer) rows than they list */
+    long countedEdges; /* edges implied by the adjacencies */
+    bool symmetric; /* every adjacency has a mirror with the same weight */
+} graphCheck;
+
+// function : edgeHash
+// Hash of the undirected edge {a, b} (a < b) with weight w
+static inline unsigned long edgeHash(long a, long b, double w) {
+    unsigned long bits;
+    memcpy(&bits, &w, sizeof(bits));
+    unsigned long h = ((unsigned long)a * 0x9E3779B97F4A7C15UL) ^ ((unsigned long)b + 0x632BE59BD9B4E019UL);
+    h = (h ^ (h >> 31)) * 0xBF58476D1CE4E5B9UL;
+    h ^= bits;
+    h = (h ^ (h >> 29)) * 0x94D049BB133111EBUL;
+    return h ^ (h >> 32);
+}
+
+// function : checkGraph
+// One parallel pass over the adjacencies of G. Symmetry is checked without
+// searching the rows: every vertex must be listed as often as it lists
+// others, and the hashes of the adjacencies (v, u, w) added for v < u and
+// subtracted for v > u must cancel out, which also catches weight
+// mismatches. Rows that are not sorted are sorted in a scratch buffer to
+// count duplicates. Returns true if no problem was found.
+bool checkGraph(graph* G, graphCheck* R) {
+    long NV = G->numVertices;
+    long* vtxPtr = G->edgeListPtrs;
+    vertexId* vtxInd = G->edgeList;
+    edgeWeight* vtxWt = G->edgeWeights;
+    long numAdj = vtxPtr[NV];
+    long* balance = (long*)malloc(NV*sizeof(long));
+    assert(balance != 0);
+    #pragma omp parallel for
+    for (long i = 0; i < NV; i++) {
+        balance[i] = 0;
+    }
+    long outOfRange = 0, selfLoops = 0, duplicates = 0, unbalanced = 0;
+    unsigned long signature = 0;
+    #pragma omp parallel reduction(+:outOfRange, selfLoops, duplicates, signature)
+    {
+        vertexId* scratch = NULL;
+        long capacity = 0;
+        #pragma omp for schedule(dynamic, 1024)
+        for (long v = 0; v < NV; v++) {
+            long listed = 0;
+            bool sorted = true;
+            for (long j = vtxPtr[v]; j < vtxPtr[v+1]; j++) {
+                long u = vtxInd[j];
+                if ((j > vtxPtr[v]) && (vtxInd[j] < vtxInd[j-1])) {
+                    sorted = false;
                 }
-                break;
-        } // End of switch(value)
+                if ((u < 0) || (u >= NV)) {
+                    outOfRange++;
+                    continue;
+                }
+                if (u == v) {
+                    selfLoops++;
+                    continue;
+                }
+                double w = (vtxWt == NULL) ? 1.0 : vtxWt[j];
+                if (v < u) {
+                    signature += edgeHash(v, u, w);
+                } else {
+                    signature -= edgeHash(u, v, w);
+                }
+                __sync_fetch_and_sub(&balance[u], 1);
+                listed++;
+            }
+            if (listed > 0) {
+                __sync_fetch_and_add(&balance[v], listed);
+            }
+            long n = vtxPtr[v+1] - vtxPtr[v];
+            vertexId* row = vtxInd + vtxPtr[v];
+            if (!sorted) {
+                if (n > capacity) {
+                    capacity = n;
+                    scratch = (vertexId*)realloc(scratch, capacity*sizeof(vertexId));
+                    assert(scratch != 0);
+                }
+                memcpy(scratch, row, n*sizeof(vertexId));
+                sortAdjacency(scratch, NULL, n);
+                row = scratch;
+            }
+            for (long j = 1; j < n; j++) {
+                if (row[j] == row[j-1]) {
+                    duplicates++;
+                }
+            }
+        }
+        free(scratch);
+    }
+    #pragma omp parallel for reduction(+:unbalanced)
+    for (long i = 0; i < NV; i++) {
+        if (balance[i] != 0) {
+            unbalanced++;
+        }
+    }
+    free(balance);
+
+    R->outOfRange = outOfRange;
+    R->selfLoops = selfLoops;
+    R->duplicates = duplicates;
+    R->unbalanced = unbalanced;
+    R->countedEdges = selfLoops + (numAdj - outOfRange - selfLoops)/2;
+    R->symmetric = (unbalanced == 0) && (signature == 0);
+    return (outOfRange == 0) && (selfLoops == 0) && (duplicates == 0) && R->symmetric
+        && (R->countedEdges == G->numEdges);
+} // End of checkGraph
+
+// function : displayGraphCheck
+void displayGraphCheck(graph* G, graphCheck* R) {
+    printf("*******************************************\n");
+    printf("Input check :\n");
+    printf("*******************************************\n");
+    printf("Out-of-range neighbors :  %ld\n", R->outOfRange);
+    printf("Self-loops             :  %ld\n", R->selfLoops);
+    printf("Duplicate adjacencies  :  %ld\n", R->duplicates);
+    printf("Unbalanced vertices    :  %ld\n", R->unbalanced);
+    printf("Symmetric              :  %s\n", R->symmetric ? "yes" : "no");
+    printf("Edges (stored/counted) :  %ld / %ld\n", G->numEdges, R->countedEdges);
+    printf("*******************************************\n");
+}
 
-        // Close the damn file! 
-        fclose(fin);
+// function : lowerBound
+// First position in the sorted ind[begin .. end-1] holding a value >= key
+static inline long lowerBound(const vertexId* ind, long begin, long end, long key) {
+    while (begin < end) {
+        long mid = begin + (end - begin)/2;
+        if (ind[mid] < key) {
+            begin = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    return begin;
+}
 
-        // Populate the graph structure
-        G->numVertices = mNVer;
-        G->sVertices = mNVer;
-        G->numEdges = mNEdge;
-        G->edgeListPtrs = mVerPtr;
-        G->edgeList = mEdgeList;
+// function : repairGraph
+// Rebuild G as a clean undirected graph: out-of-range neighbors and
+// self-loops are dropped, repeated neighbors are merged by adding their
+// weights, and an adjacency without a mirror gets one. When both
+// directions exist with different weights, the larger one is kept.
+// Mapped graphs are brought into memory; vertex weights are kept.
+void repairGraph(graph* G) {
+    long NV = G->numVertices;
+    long* vtxPtr = G->edgeListPtrs;
+    vertexId* vtxInd = G->edgeList;
+    edgeWeight* vtxWt = G->edgeWeights;
+
+    // Step 1 : sorted rows of the valid directed adjacencies
+    long* rowCount = (long*)malloc((NV+1)*sizeof(long));
+    assert(rowCount != 0);
+    rowCount[0] = 0;
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (long v = 0; v < NV; v++) {
+        long valid = 0;
+        for (long j = vtxPtr[v]; j < vtxPtr[v+1]; j++) {
+            if ((vtxInd[j] >= 0) && (vtxInd[j] < NV) && (vtxInd[j] != v)) {
+                valid++;
+            }
+        }
+        rowCount[v+1] = valid;
+    }
+    parallelPrefixSum(rowCount+1, NV);
+    long numDirected = rowCount[NV];
+    vertexId* src = (vertexId*)malloc(numDirected*sizeof(vertexId));
+    vertexId* dst = (vertexId*)malloc(numDirected*sizeof(vertexId));
+    edgeWeight* wt = (edgeWeight*)malloc(numDirected*sizeof(edgeWeight));
+    assert((src != 0) && (dst != 0) && (wt != 0));
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (long v = 0; v < NV; v++) {
+        long Where = rowCount[v];
+        for (long j = vtxPtr[v]; j < vtxPtr[v+1]; j++) {
+            if ((vtxInd[j] >= 0) && (vtxInd[j] < NV) && (vtxInd[j] != v)) {
+                src[Where] = v;
+                dst[Where] = vtxInd[j];
+                wt[Where] = (vtxWt == NULL) ? 1 : vtxWt[j];
+                Where++;
+            }
+        }
+    }
+    long* vertexWeights = G->vertexWeights;
+    G->vertexWeights = NULL; // Kept across the rebuild
+    if (G->mapBase != NULL) {
+        munmap(G->mapBase, G->mapSize);
+    } else {
+        free(vtxPtr);
+        free(vtxInd);
+        free(vtxWt);
+    }
+    graph D;
+    buildGraphFromEdgeList(&D, NV, numDirected, src, dst, wt, true);
+    free(src);
+    free(dst);
+    free(wt);
+
+    // Step 2 : one undirected edge per pair of vertices. A pair listed from
+    // both ends is emitted by its smaller end, a one-sided pair by its only end.
+    long* ptr = D.edgeListPtrs;
+    vertexId* ind = D.edgeList;
+    edgeWeight* w = D.edgeWeights;
+    long* edgeStart = rowCount; // Reused: undirected edges emitted by every row
+    for (int pass = 0; pass < 2; pass++) {
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (long v = 0; v < NV; v++) {
+            long emitted = 0;
+            for (long j = ptr[v]; j < ptr[v+1]; ) {
+                long u = ind[j];
+                double forward = 0, backward = 0;
+                for (; (j < ptr[v+1]) && (ind[j] == u); j++) {
+                    forward += w[j];
+                }
+                long k = lowerBound(ind, ptr[u], ptr[u+1], v);
+                bool mirrored = (k < ptr[u+1]) && (ind[k] == v);
+                for (; (k < ptr[u+1]) && (ind[k] == v); k++) {
+                    backward += w[k];
+                }
+                if (mirrored && (u < v)) {
+                    continue; // Emitted from u
+                }
+                if (pass == 1) {
+                    long Where = edgeStart[v] + emitted;
+                    src[Where] = v;
+                    dst[Where] = u;
+                    wt[Where] = (forward > backward) ? forward : backward;
+                }
+                emitted++;
+            }
+            if (pass == 0) {
+                edgeStart[v+1] = emitted;
+            }
+        }
+        if (pass == 0) {
+            parallelPrefixSum(edgeStart+1, NV);
+            src = (vertexId*)malloc(edgeStart[NV]*sizeof(vertexId));
+            dst = (vertexId*)malloc(edgeStart[NV]*sizeof(vertexId));
+            wt = (edgeWeight*)malloc(edgeStart[NV]*sizeof(edgeWeight));
+            assert((src != 0) && (dst != 0) && (wt != 0));
+        }
+    }
+    long numEdges = edgeStart[NV];
+    free(ptr);
+    free(ind);
+    free(w);
+    free(rowCount);
+
+    // Step 3 : the symmetric CSR; unit weights are dropped again
+    int allUnit = 1;
+    #pragma omp parallel for reduction(&&:allUnit)
+    for (long k = 0; k < numEdges; k++) {
+        allUnit = allUnit && (wt[k] == 1);
+    }
+    buildGraphFromEdgeList(G, NV, numEdges, src, dst, allUnit ? NULL : wt, false);
+    G->vertexWeights = vertexWeights;
+    free(src);
+    free(dst);
+    free(wt);
+} // End of repairGraph
+
+// struct : edgeUpdate
+// One direction of an edge batch line; order is the line number
+typedef struct edgeUpdate {
+    vertexId src;
+    vertexId dst;
+    long order;
+    double add; /* weight added by a '+' line, 0 for '-' */
+    bool remove; /* '-' line: the edge is deleted */
+} edgeUpdate;
+
+// function : compareEdgeUpdates
+// qsort order of edge updates: by source, neighbor, then line
+int compareEdgeUpdates(const void* a, const void* b) {
+    const edgeUpdate* x = (const edgeUpdate*)a;
+    const edgeUpdate* y = (const edgeUpdate*)b;
+    if (x->src != y->src) {
+        return (x->src < y->src) ? -1 : 1;
+    }
+    if (x->dst != y->dst) {
+        return (x->dst < y->dst) ? -1 : 1;
+    }
+    return (x->order < y->order) ? -1 : (x->order > y->order);
+} // End of compareEdgeUpdates
+
+// function : readEdgeBatch
+// Parse an edge batch: "+ u v [w]" inserts the edge {u,v} (or adds w, default 1,
+// to its weight) and "- u v" deletes it, with 0-based vertex ids; blank lines
+// and lines starting with '#' or '%' are skipped. Batches are small, so they
+// are parsed sequentially. Every line gives both directions (self-loops one).
+// Returns the number of updates in *updates, or -1 on failure.
+long readEdgeBatch(const char* filename, edgeUpdate** updates) {
+    size_t fileSize = 0;
+    char* data = mapInputFile(filename, &fileSize);
+    if (data == NULL) {
+        return -1;
+    }
+    const char* end = data + fileSize;
+    long numLines = 0;
+    for (const char* s = data; s < end; s = nextLine(s, end)) {
+        numLines++;
+    }
+    edgeUpdate* upd = (edgeUpdate*)malloc(2 * numLines * sizeof(edgeUpdate));
+    assert(upd != 0);
+    long n = 0, line = 0;
+    for (const char* s = data; s < end; s = nextLine(s, end)) {
+        const char* e = nextLine(s, end);
+        const char* t = skipBlanks(s, e);
+        line++;
+        if ((t == e) || (*t == '\n') || (*t == '#') || (*t == '%')) {
+            continue;
+        }
+        long u = -1, v = -1;
+        double w = 1;
+        bool remove = (*t == '-');
+        const char* x = ((*t == '+') || remove) ? skipBlanks(t+1, e) : t;
+        const char* y = scanLong(x, e, &u);
+        const char* z = (y == x) ? y : scanLong(skipBlanks(y, e), e, &v);
+        if ((x == t) || (y == x) || (z == skipBlanks(y, e)) || (u < 0) || (v < 0)) {
+            fprintf(stderr, "Line %ld of the edge batch %s is not \"+ u v [w]\" or \"- u v\"\n", line, filename);
+            free(upd);
+            munmap(data, fileSize);
+            return -1;
+        }
+        if (!remove) {
+            scanDouble(skipBlanks(z, e), e, &w); // Optional weight
+        }
+        if ((u > VERTEX_ID_MAX) || (v > VERTEX_ID_MAX)) {
+            fprintf(stderr, "Line %ld of the edge batch %s: vertex id does not fit this build\n", line, filename);
+            free(upd);
+            munmap(data, fileSize);
+            return -1;
+        }
+        for (int d = 0; d < ((u == v) ? 1 : 2); d++) {
+            upd[n].src = (d == 0) ? u : v;
+            upd[n].dst = (d == 0) ? v : u;
+            upd[n].order = line;
+            upd[n].add = remove ? 0 : w;
+            upd[n].remove = remove;
+            n++;
+        }
+    }
+    munmap(data, fileSize);
+    *updates = upd;
+    return n;
+} // End of readEdgeBatch
+
+// function : findUpdate
+// Index of the update to neighbor x in the sorted updates [begin, end) of a vertex, -1 if none
+static inline long findUpdate(const edgeUpdate* upd, long begin, long end, long x) {
+    long lo = begin, hi = end;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (upd[mid].dst < x) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return ((lo < end) && (upd[lo].dst == x)) ? lo : -1;
+}
 
-        return true;
-    } // End 
+// function : applyEdgeBatch
+// Patch G in place with an edge batch (readEdgeBatch) instead of reloading it.
+// The lines of one pair are folded in order: a deletion drops the edge and
+// any weight added before it, an insertion adds its weight (creating the edge
+// if needed). Rows without updates are copied as they are and only the rows
+// of updated vertices are rebuilt; ids beyond the graph add vertices (not for
+// inputs with original ids). Mapped graphs are brought into memory. On success
+// *affected holds a flag for every updated vertex and its neighbors.
+bool applyEdgeBatch(graph* G, const char* filename, bool hasOrigIds, unsigned char** affected) {
+    double time1 = omp_get_wtime();
+    edgeUpdate* upd = NULL;
+    long n = readEdgeBatch(filename, &upd);
+    if (n < 0) {
+        return false;
+    }
+    long NV = G->numVertices;
+    long* vtxPtr = G->edgeListPtrs;
+    vertexId* vtxInd = G->edgeList;
+    edgeWeight* vtxWt = G->edgeWeights;
+    long newNV = NV;
+    for (long k = 0; k < n; k++) {
+        if (upd[k].src >= newNV) {
+            newNV = upd[k].src + 1;
+        }
+    }
+    if ((newNV > NV) && hasOrigIds) {
+        fprintf(stderr, "The edge batch %s adds vertices to a graph with original ids\n", filename);
+        free(upd);
+        return false;
+    }
+
+    // Step 1 : fold the updates of every pair into one (drop, then add)
+    qsort(upd, n, sizeof(edgeUpdate), compareEdgeUpdates);
+    long m = 0;
+    for (long k = 0; k < n; k++) {
+        if ((m > 0) && (upd[m-1].src == upd[k].src) && (upd[m-1].dst == upd[k].dst)) {
+            if (upd[k].remove) {
+                upd[m-1].remove = true;
+                upd[m-1].add = 0;
+            } else {
+                upd[m-1].add += upd[k].add;
+            }
+        } else {
+            upd[m++] = upd[k];
+        }
+    }
+    long* updPtr = (long*)malloc((newNV+1) * sizeof(long)); // Updates of every vertex
+    long* matchPos = (long*)malloc(m * sizeof(long)); // Adjacency an update applies to, -1 if new
+    long* newPtr = (long*)malloc((newNV+1) * sizeof(long));
+    assert((updPtr != 0) && (matchPos != 0) && (newPtr != 0));
+    #pragma omp parallel for
+    for (long v = 0; v <= newNV; v++) {
+        updPtr[v] = 0;
+    }
+    for (long k = 0; k < m; k++) {
+        updPtr[upd[k].src + 1]++;
+    }
+    parallelPrefixSum(updPtr+1, newNV);
+
+    // Step 2 : new row lengths; a pair updates the first adjacency to its neighbor
+    long added = 0, removed = 0;
+    int unit = (vtxWt == NULL);
+    newPtr[0] = 0;
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+:added,removed) reduction(&&:unit)
+    for (long v = 0; v < newNV; v++) {
+        long begin = (v < NV) ? vtxPtr[v] : 0;
+        long end = (v < NV) ? vtxPtr[v+1] : 0;
+        long length = end - begin;
+        for (long k = updPtr[v]; k < updPtr[v+1]; k++) {
+            matchPos[k] = -1;
+        }
+        if (updPtr[v] == updPtr[v+1]) {
+            newPtr[v+1] = length;
+            continue;
+        }
+        for (long j = begin; j < end; j++) {
+            long k = findUpdate(upd, updPtr[v], updPtr[v+1], vtxInd[j]);
+            if ((k >= 0) && (matchPos[k] < 0)) {
+                matchPos[k] = j;
+            }
+        }
+        for (long k = updPtr[v]; k < updPtr[v+1]; k++) {
+            bool counted = (upd[k].dst >= v); // Count every undirected edge once
+            if (matchPos[k] >= 0) {
+                if (upd[k].remove && (upd[k].add == 0)) {
+                    length--;
+                    removed += counted;
+                } else if (upd[k].remove ? (upd[k].add != 1) : (upd[k].add != 0)) {
+                    unit = 0;
+                }
+            } else if (upd[k].add != 0) {
+                length++;
+                added += counted;
+                unit = unit && (upd[k].add == 1);
+            }
+        }
+        newPtr[v+1] = length;
+    }
+    parallelPrefixSum(newPtr+1, newNV);
+
+    // Step 3 : copy untouched rows, rebuild updated ones
+    long numAdj = newPtr[newNV];
+    vertexId* newInd = (vertexId*)malloc(numAdj * sizeof(vertexId));
+    assert(newInd != 0);
+    edgeWeight* newWt = NULL;
+    if (!unit) {
+        newWt = (edgeWeight*)malloc(numAdj * sizeof(edgeWeight));
+        assert(newWt != 0);
+    }
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (long v = 0; v < newNV; v++) {
+        long begin = (v < NV) ? vtxPtr[v] : 0;
+        long end = (v < NV) ? vtxPtr[v+1] : 0;
+        long Where = newPtr[v];
+        if (updPtr[v] == updPtr[v+1]) {
+            memcpy(&newInd[Where], &vtxInd[begin], (end - begin) * sizeof(vertexId));
+            if (newWt != NULL) {
+                for (long j = begin; j < end; j++) {
+                    newWt[Where + j - begin] = (vtxWt == NULL) ? 1 : vtxWt[j];
+                }
+            }
+            continue;
+        }
+        for (long j = begin; j < end; j++) {
+            double w = (vtxWt == NULL) ? 1 : vtxWt[j];
+            long k = findUpdate(upd, updPtr[v], updPtr[v+1], vtxInd[j]);
+            if ((k >= 0) && (matchPos[k] == j)) {
+                if (upd[k].remove && (upd[k].add == 0)) {
+                    continue;
+                }
+                w = upd[k].remove ? upd[k].add : w + upd[k].add;
+            }
+            newInd[Where] = vtxInd[j];
+            if (newWt != NULL) {
+                newWt[Where] = w;
+            }
+            Where++;
+        }
+        for (long k = updPtr[v]; k < updPtr[v+1]; k++) {
+            if ((matchPos[k] < 0) && (upd[k].add != 0)) {
+                newInd[Where] = upd[k].dst;
+                if (newWt != NULL) {
+                    newWt[Where] = upd[k].add;
+                }
+                Where++;
+            }
+        }
+    }
+
+    // Step 4 : swap in the new arrays
+    if (G->mapBase != NULL) {
+        munmap(G->mapBase, G->mapSize);
+        G->mapBase = NULL;
+        G->mapSize = 0;
+    } else {
+        free(vtxPtr);
+        free(vtxInd);
+        free(vtxWt);
+    }
+    G->edgeListPtrs = newPtr;
+    G->edgeList = newInd;
+    G->edgeWeights = newWt;
+    if (G->vertexWeights != NULL) {
+        long* vertexWeights = (long*)malloc(newNV * sizeof(long));
+        assert(vertexWeights != 0);
+        memcpy(vertexWeights, G->vertexWeights, NV * sizeof(long));
+        for (long v = NV; v < newNV; v++) {
+            vertexWeights[v] = 1; // METIS default
+        }
+        free(G->vertexWeights);
+        G->vertexWeights = vertexWeights;
+    }
+    G->numVertices = newNV;
+    G->sVertices = newNV;
+    G->numEdges += added - removed;
+
+    // Step 5 : the updated vertices and their neighbors
+    unsigned char* flag = (unsigned char*)malloc(newNV * sizeof(unsigned char));
+    assert(flag != 0);
+    #pragma omp parallel for
+    for (long v = 0; v < newNV; v++) {
+        flag[v] = 0;
+    }
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (long k = 0; k < m; k++) {
+        vertexId v = upd[k].src;
+        flag[v] = 1; // Racing writers all store 1
+        for (long j = newPtr[v]; j < newPtr[v+1]; j++) {
+            flag[newInd[j]] = 1;
+        }
+    }
+    long numAffected = 0;
+    #pragma omp parallel for reduction(+:numAffected)
+    for (long v = 0; v < newNV; v++) {
+        numAffected += flag[v];
+    }
+    *affected = flag;
+    printf("Edge batch: %ld updates, %ld edges added, %ld removed, %ld new vertices, %ld affected vertices (%3.3lf)\n",
+            m, added, removed, newNV - NV, numAffected, omp_get_wtime() - time1);
+
+    free(upd);
+    free(updPtr);
+    free(matchPos);
+    return true;
+} // End of applyEdgeBatch
+
+// function : loadPartition
+// Read clusters as written by -o: one line per vertex with its cluster id, or
+// "origId cluster" (the last number is used). Like readEdgeLines, the lines
+// are split into one chunk per thread, counted, then parsed into place.
+// At most maxLines lines with ids in [-1, maxLines) are accepted; returns
+// their number, -1 on failure.
+long loadPartition(const char* filename, long maxLines, long* P) {
+    size_t fileSize = 0;
+    char* data = mapInputFile(filename, &fileSize);
+    if (data == NULL) {
+        return -1;
+    }
+    const char* end = data + fileSize;
+    int nChunks = omp_get_max_threads();
+    if (fileSize < (1L << 20)) {
+        nChunks = 1; // Not worth splitting small files
+    }
+    const char** chunkStart = (const char**)malloc((nChunks+1) * sizeof(char*));
+    long* chunkLine = (long*)malloc((nChunks+1) * sizeof(long));
+    assert((chunkStart != 0) && (chunkLine != 0));
+    splitAtNewlines(data, end, nChunks, chunkStart);
+    chunkLine[0] = 0;
+    #pragma omp parallel for schedule(static, 1)
+    for (int c = 0; c < nChunks; c++) {
+        long lines = 0;
+        for (const char* s = chunkStart[c]; s < chunkStart[c+1]; s = nextLine(s, end)) {
+            const char* t = skipBlanks(s, end);
+            lines += (t < end) && (*t != '\n');
+        }
+        chunkLine[c+1] = lines;
+    }
+    for (int c = 0; c < nChunks; c++) {
+        chunkLine[c+1] += chunkLine[c];
+    }
+    long numLines = chunkLine[nChunks];
+    bool parseError = false;
+    if (numLines <= maxLines) {
+        #pragma omp parallel for schedule(static, 1) reduction(||:parseError)
+        for (int c = 0; c < nChunks; c++) {
+            long k = chunkLine[c];
+            for (const char* s = chunkStart[c]; s < chunkStart[c+1]; s = nextLine(s, end)) {
+                const char* e = nextLine(s, end);
+                const char* t = skipBlanks(s, e);
+                if ((t == e) || (*t == '\n')) {
+                    continue;
+                }
+                const char* x = scanLong(t, e, &P[k]);
+                const char* y = skipBlanks(x, e);
+                if (x == t) {
+                    parseError = true;
+                    break;
+                }
+                scanLong(y, e, &P[k]); // Second column of "origId cluster"
+                if ((P[k] < -1) || (P[k] >= maxLines)) {
+                    parseError = true;
+                    break;
+                }
+                k++;
+            }
+        }
+    }
+    free(chunkStart);
+    free(chunkLine);
+    munmap(data, fileSize);
+    if (numLines > maxLines) {
+        fprintf(stderr, "%s has %ld lines, more than the %ld vertices of the graph\n", filename, numLines, maxLines);
+        return -1;
+    }
+    if (parseError) {
+        fprintf(stderr, "%s is not a cluster file (one id between -1 and %ld per line)\n", filename, maxLines-1);
+        return -1;
+    }
+    return numLines;
+} // End of loadPartition
 
     // function : displayGraphCharacteristics
     void displayGraphCharacteristics(graph* G) {
@@ -671,18 +3101,25 @@ long countTokens(char* line, char* delimiter) {
             printf("Isolated vertices    :  %ld (%3.2lf%%)\n", isolated, ((double)isolated/tNV)*100);
             printf("Degree-one vertices  :  %ld (%3.2lf%%)\n", degreeOne, ((double)degreeOne/tNV)*100);
             printf("Density              :  %lf%%\n",((double)NE/(NV*NV))*100);
+            if (G->vertexWeights != NULL) {
+                long totalVertexWeight = 0;
+                for (long i = 0; i < NV; i++) {
+                    totalVertexWeight += G->vertexWeights[i];
+                }
+                printf("Total vertex weight  :  %ld\n", totalVertexWeight);
+            }
             printf("*******************************************\n");
         }
     }
 
     // function : vertexFollowing
-    long vertexFollowing(graph* G, long* C) {
+    long vertexFollowing(graph* G, vertexId* C) {
 #ifdef DETAILED
         printf("Inside vertexFollowing\n");
 #endif
         long NV = G->numVertices;
         long *vtxPtr = G->edgeListPtrs;
-        edge *vtxInd = G->edgeList;
+        vertexId *vtxInd = G->edgeList;
         long numNode = 0;
         //clock_t start = clock();
         double start = omp_get_wtime();
@@ -697,171 +3134,73 @@ long countTokens(char* line, char* delimiter) {
         // Remove isolated and degree-one vertices
         //#pragma omp parallel for
         for (long i = 0; i < NV; i++) {
-            long adj1 = vtxPtr[i];
-            long adj2 = vtxPtr[i+1];
-            if (adj1 == adj2) { // Isolated vertex
-                C[i] = -1;
-                //__sync_fetch_and_add(&numNode, 1);
-                numNode += 1;
-            } else if ((adj2 - adj1) == 1) { // Degree one
-                // Check if the tail has degree of greater than 1
-                long tail = vtxInd[adj1].tail;
-                long adj11 = vtxPtr[tail];
-                long adj12 = vtxPtr[tail+1];
-                if ((adj12 - adj11) > 1 || i > tail) { // Degree of tail is greater than 1
-                    //__sync_fetch_and_add(&numNode, 1);
-                    numNode += 1;
-                    C[i] = tail;
-                } // else, chill!
-            } 
-        } // End of for
-        start = omp_get_wtime() - start;
-        //printf("Time to determine number of vertices (numNode) to fix: %lf\n", (double)start/CLOCKS_PER_SEC);
-#ifdef DETAILED
-        printf("Time to determine number of vertices (numNode) to fix: %3.3lf\n", start);
-#endif
-        return numNode;
-    }
-
-    typedef struct dataItem {
-        long data;
-        long key;
-    } dataItem;
-
-    // function : hashCode
-    long hashCode(long key, long size) {
-        return(key % size);
-    }
-
-    // function : search
-    dataItem* search(long key, long size, dataItem** hashArr) {
-        // get the hash
-#ifdef DEBUG_SEARCH
-        printf("Inside search : key=%ld size=%ld\n", key, size);
-#endif
-        long hashIndex = hashCode(key, size);
-#ifdef DEBUG_SEARCH
-        printf("hashIndex : %ld\n", hashIndex);
-#endif
-
-        // move in array until an empty
-        while (hashArr[hashIndex] != NULL) {
-            if (hashArr[hashIndex]->key == key) {
-                return hashArr[hashIndex];
-            }
-
-            // go to the next cell
-            ++hashIndex;
-
-            // wrap around the table
-            hashIndex = hashIndex % size;
-        }
-        return NULL;
-    }
-
-    // function : displayHashMap
-    void displayHashMap(dataItem** hashArr, long size) {
-        for (long i = 0; i < size; i++) {
-            if (hashArr[i] != NULL) {
-                printf("i : %ld = (%ld, %ld)", i, hashArr[i]->key, hashArr[i]->data);
-            } else {
-                printf("i : %ld = ~~ ", i);
-            }
-        }
-        printf("\n");
-    }
-
-    // function : insert
-    void insert(long key, long data, long size, dataItem** hashArr) {
-        dataItem* item = (dataItem*)malloc(sizeof(dataItem));
-        //printf("key : %ld   data : %ld\n", key, data);
-        assert(item != 0);
-        item->key = key;
-        item->data = data;
-
-        // get the hash
-        long hashIndex = hashCode(key, size);
-
-        // move in the array until an empty or deleted cell
-        while ((hashArr[hashIndex] != NULL) && (hashArr[hashIndex]->key != -1)) {
-            // go to the next cell
-            ++hashIndex;
-
-            // wrap around the table
-            hashIndex = hashIndex % size;
-        }
-        hashArr[hashIndex] = item;
-        //printf("Inside insert : key : %ld   data : %ld\n", hashArr[hashIndex]->key, hashArr[hashIndex]->data);
-    }
-
-    // function : delete
-    dataItem* delete(dataItem* item, long size, dataItem** hashArr) {
-        long key = item->key;
-
-        // get the hash
-        long hashIndex = hashCode(key, size);
-
-        // move in array until an empty
-        while(hashArr[hashIndex] != NULL) {
-            if (hashArr[hashIndex]->key == key) {
-                hashArr[hashIndex]->key = -1;
-                hashArr[hashIndex]->data = -1;
-                return hashArr[hashIndex];
-            }
-            // go to the next cell
-            ++hashIndex;
-
-            // wrap around the table
-            hashIndex %= size;
-        }
-        return NULL;
+            long adj1 = vtxPtr[i];
+            long adj2 = vtxPtr[i+1];
+            if (adj1 == adj2) { // Isolated vertex
+                C[i] = -1;
+                //__sync_fetch_and_add(&numNode, 1);
+                numNode += 1;
+            } else if ((adj2 - adj1) == 1) { // Degree one
+                // Check if the tail has degree of greater than 1
+                long tail = vtxInd[adj1];
+                long adj11 = vtxPtr[tail];
+                long adj12 = vtxPtr[tail+1];
+                if ((adj12 - adj11) > 1 || i > tail) { // Degree of tail is greater than 1
+                    //__sync_fetch_and_add(&numNode, 1);
+                    numNode += 1;
+                    C[i] = tail;
+                } // else, chill!
+            } 
+        } // End of for
+        start = omp_get_wtime() - start;
+        //printf("Time to determine number of vertices (numNode) to fix: %lf\n", (double)start/CLOCKS_PER_SEC);
+#ifdef DETAILED
+        printf("Time to determine number of vertices (numNode) to fix: %3.3lf\n", start);
+#endif
+        return numNode;
     }
 
-    // function : freeHashArr
-    void freeHashArr(dataItem** hashArr, long size) {
-        for (long i = 0; i < size; i++) {
-            free(hashArr[i]);
-        }
-        free(hashArr);
-    }
+    typedef struct dataItem {
+        vertexId data;
+        vertexId key;
+    } dataItem;
 
     // function : renumberClustersContiguously
     // WARNING : will overwrite the old cluster
+    // Cluster ids are bounded by size: flag every id in use, and the prefix
+    // sum of the flags gives the new ids, in the order of the old ones
     // Returns the number of unique clusters
-    long renumberClustersContiguously(long* C, long size) {
+    long renumberClustersContiguously(vertexId* C, long size) {
 #ifdef DETAILED
         printf("Inside renumberClustersContiguously\n");
 #endif
-        //clock_t start = clock();
         double start = omp_get_wtime();
-        // count the number of communities and internal edges
-        // map each neighbor's cluster to a local number
-        dataItem** hashArr = (dataItem**)malloc(size * sizeof(dataItem*));
+        long* newId = (long*)malloc(size * sizeof(long));
+        assert(newId != 0);
+        #pragma omp parallel for
         for (long i = 0; i < size; i++) {
-            hashArr[i] = NULL;
+            newId[i] = 0;
         }
-        dataItem* temp = (dataItem*)malloc(sizeof(dataItem));
-
-        long numUniqueClusters = 0;
 
-        // Do this loop in serial
-        // will overwrite the old cluster id with new cluster id
+        // Flag the cluster ids in use (concurrent writers all store 1)
+        #pragma omp parallel for
         for (long i = 0; i < size; i++) {
             assert(C[i] < size);
             if (C[i] >= 0) { // only if it is a valid number
-                temp = search(C[i], size, hashArr); // check if it already exists
-                if (temp != NULL) {
-                    C[i] = temp->data;
-                } else {
-                    insert(C[i], numUniqueClusters, size, hashArr); // Doesn't exist, add to the map
-                    C[i] = numUniqueClusters; // Renumber the cluster id
-                    numUniqueClusters++; // increment the number
-                }
+                newId[C[i]] = 1;
+            }
+        }
+        parallelPrefixSum(newId, size);
+        long numUniqueClusters = (size > 0) ? newId[size-1] : 0;
+
+        // will overwrite the old cluster id with new cluster id
+        #pragma omp parallel for
+        for (long i = 0; i < size; i++) {
+            if (C[i] >= 0) {
+                C[i] = newId[C[i]] - 1; // Inclusive sum counts the id itself
             }
-        } // end of for
-        //displayHashMap(hashArr, size);
-        freeHashArr(hashArr, size);
-        //free(temp);
+        }
+        free(newId);
         start = omp_get_wtime() - start;
 #ifdef DETAILED
         printf("Time to renumber clusters: %3.3lf\n", start);
@@ -869,733 +3208,554 @@ long countTokens(char* line, char* delimiter) {
         return numUniqueClusters; // Return the number of unique cluster ids
     }
 
-    // function : buildNewGraphVF
-    // WARNING : will assume that cluster id have been renumbered contiguously
-    // Return the total time for building the next level of graph
-    // This will not add any self-loops
-    double buildNewGraphVF(graph* Gin, graph* Gout, long* C, long numUniqueClusters) {
-        // I don't understand the point of this right now
-        /*
-           int nT;
-#pragma omp parallel
-{
-nT = omp_get_num_threads();
-}
-*/
-#ifdef DETAILED
-    printf("Inside buildNewGraphVF: # of unique clusters= %ld\n",numUniqueClusters);
-#endif
-    /*
-       printf("Actual number of threads: %d \n", nT);
-       */
-    //clock_t start, end; 
-    double start, end; 
-    double totTime = 0; // For timing purposes
-    double total = 0, totItr = 0;
-
-    // Pointers into the graph structure
-    long NV_in = Gin->numVertices;
-    long NE_in = Gin->numEdges;
-    long* vtxPtrIn = Gin->edgeListPtrs;
-    edge* vtxIndIn = Gin->edgeList;
-
-    start = omp_get_wtime();
-
-    // Pointers into the output graph structure
-    long NV_out = numUniqueClusters;
-    long NE_self = 0; // Not all vertices get self-loops
-    long NE_out = 0; // Cross edges
-    long* vtxPtrOut = (long*)malloc((NV_out+1)*sizeof(long));
-    assert(vtxPtrOut != 0);
-    vtxPtrOut[0] = 0; // First location is always 0
-
-    /* Step 1 : Regroup the node into cluster node */
-    dataItem*** cluPtrIn = (dataItem***)malloc(numUniqueClusters * sizeof(dataItem**));
-    assert(cluPtrIn != 0);
-    long* sizeArr = (long*)malloc(numUniqueClusters * sizeof(long));
-    assert(sizeArr != 0);
-
-    // Care about it later
-    /* 
-#pragma omp parallel for
-*/
-
-    // Not sure if needed! Commenting for now
-    /*
-       for (long i = 0; i < numUniqueClusters; i++) {
-       cluPtrIn[i] = malloc(sizeof(dataItem*));
-    // Do not add self-loops
-    // (*(cluPtrIn[i]))[i] = 0; //Add for a self loop with zero weight
-    }
-    */
-
-    // Care about it later
-    /* 
-#pragma omp parallel for
-*/
-    for (long i = 1; i <= NV_out; i++) {
-        vtxPtrOut[i] = 0;
-    }
-
-// Care about this later
-// Create an array of locks for each cluster
-/*
-   omp_lock_t *nlocks = (omp_lock_t *) malloc (numUniqueClusters * sizeof(omp_lock_t));
-   assert(nlocks != 0);
-#pragma omp parallel for
-for (long i=0; i<numUniqueClusters; i++) {
-omp_init_lock(&nlocks[i]); //Initialize locks
-}
-*/
-
-end = omp_get_wtime();
-totTime += (end - start);
-#ifdef DETAILED
-printf("Time to initialize: %3.3lf\n", (end - start));
-#endif
-
-start = omp_get_wtime();
-// Care about it later
-/* 
-#pragma omp parallel for
-*/
-
-//size for community hash
-for (long i = 0; i < NV_in; i++) {
-    if ( (C[i] < 0) || (C[i] > numUniqueClusters) ) {
-        continue; // Not a valid cluster id
+// function : partitionSeed
+// Starting clusters of the graph to cluster (NV vertices) from P, the clusters
+// (below NV_in) of the first numLines of the NV_in input vertices; vfMap maps
+// input vertices to the graph after vertex following, or is NULL. Vertices
+// without a cluster (missing lines, -1 entries) become singletons. The ids
+// are renumbered contiguously, so seed is valid for seedCommAss.
+void partitionSeed(const long* P, long numLines, const vertexId* vfMap, long NV_in, long NV, vertexId* seed) {
+    vertexId* tmp = (vertexId*)malloc(NV_in * sizeof(vertexId)); // Ids range up to NV_in
+    assert(tmp != 0);
+    #pragma omp parallel for
+    for (long v = 0; v < NV_in; v++) {
+        tmp[v] = -1;
     }
-    long adj1 = vtxPtrIn[i];
-    long adj2 = vtxPtrIn[i+1];
-    for (long j = adj1; j < adj2; j++) {
-        long tail = vtxIndIn[j].tail;
-        assert(C[tail] < numUniqueClusters);
-        if (C[i] > C[tail]) {
-            sizeArr[C[i]]++;
+    #pragma omp parallel for
+    for (long i = 0; i < numLines; i++) {
+        long v = (vfMap == NULL) ? i : vfMap[i];
+        if ((v >= 0) && (P[i] >= 0)) {
+            __sync_bool_compare_and_swap(&tmp[v], -1, (vertexId)P[i]); // Any member's cluster
         }
-        if (C[i] == C[tail] && i <= tail) {
-            sizeArr[C[i]]++;
-        }
-    }
-    cluPtrIn[C[i]] = (dataItem**)malloc(sizeArr[C[i]] * (sizeof(dataItem)));
-    for (long k = 0; k < sizeArr[C[i]]; k++) {
-        cluPtrIn[C[i]][k] = NULL;
     }
-}
-
-for (long i = 0; i < NV_in; i++) {
-    if ( (C[i] < 0) || (C[i] > numUniqueClusters) ) {
-        continue; // Not a valid cluster id
+    long numClusters = renumberClustersContiguously(tmp, NV_in);
+    for (long v = 0; v < NV; v++) {
+        seed[v] = (tmp[v] >= 0) ? tmp[v] : numClusters++;
     }
-    long adj1 = vtxPtrIn[i];
-    long adj2 = vtxPtrIn[i+1];
-#ifdef DEBUG_B
-    printf("adj1 : %ld  adj2 : %ld\n", adj1, adj2);
-    printf("Community of i : %ld is %ld\n", i, C[i]);
-#endif
-    dataItem* temp = (dataItem*)malloc(sizeof(dataItem));
-    assert(temp != 0);
-    /*
-       long size = 0;
-       for (long j = adj1; j < adj2; j++) {
-       long tail = vtxIndIn[j].tail;
-       assert(C[tail] < numUniqueClusters);
-       if (C[i] >= C[tail]) {
-       size++;
-       }
-       }
-       */
-#ifdef DEBUG_B
-    printf("For i=%ld : size is %ld\n", i, sizeArr[C[i]]);
-#endif
-    //sizeArr[i] = size;
-    // Now look for all the neighbors of this cluster
-    for (long j = adj1; j < adj2; j++) {
-        long tail = vtxIndIn[j].tail;
-        assert(C[tail] < numUniqueClusters);
-        // Add the edge from one endpoint
-        if (C[i] >= C[tail]) { // Figure out why this condition?
-            // Care about this later
-            /*
-               omp_set_lock(&nlocks[C[i]]);  // Locking the cluster
-               */
-#ifdef DEBUG_B
-            printf("tail for i : %ld, j : %ld is %ld\n", i, j, tail);
-            printf("community of tail is C[%ld] : %ld\n", tail, C[tail]);
-            printf("Inside for loop j for i=%ld\n", i);
-            printf("community of i=%ld is %ld\n", i, C[i]);
-#endif
-            temp = search(C[tail], sizeArr[C[i]], cluPtrIn[C[i]]);
-#ifdef DEBUG_B
-            printf("temp is %p\n", temp);
-
-#endif
-            //printf("Dude\n");
-            //printf("sizeArr[0] : %ld\n", sizeArr[0]);
-            //displayHashMap(cluPtrIn[0], sizeArr[0]);
-            //printf("Dude\n");
-            if (temp != NULL) {
-                //displayHashMap(cluPtrIn[C[i]], sizeArr[C[i]]);
-                temp->data += (long)vtxIndIn[j].weight;
-                //displayHashMap(cluPtrIn[C[i]], sizeArr[C[i]]);
-                //printf("C[i] is %ld\n", C[i]);
-                //printf("C[tail] is %ld\n", C[tail]);
-                //printf("i is %ld\n", i);
-                //printf("temp->data : %ld\n", temp->data);
-            } else {
-#ifdef DEBUG_B
-                printf("inside j : %ld and edge weight is vtxIndIn[%ld].weight : %ld\n", j, j, (long)vtxIndIn[j].weight);
-#endif
-                insert(C[tail], (long)vtxIndIn[j].weight, sizeArr[C[i]], cluPtrIn[C[i]]); // Inter-community edge
-                //__sync_fetch_and_add(&vtxPtrOut[C[i]+1], 1);
-                vtxPtrOut[C[i]+1] = vtxPtrOut[C[i]+1] + 1;
-                if (C[i] == C[tail]) {
-                    // Keep track of self edges
-                    //__sync_fetch_and_add(&NE_self, 1);
-                    NE_self++;
-                }
-                if (C[i] > C[tail]) {
-                    //Keep track of non-self #edges
-                    //__sync_fetch_and_add(&NE_out, 1);
-                    NE_out++;
-                    //Count edge j-->i
-                    //__sync_fetch_and_add(&vtxPtrOut[C[tail]+1], 1);
-                    vtxPtrOut[C[tail]+1] = vtxPtrOut[C[tail]+1] + 1;
-                }
-            }
-            /* Dont understand the point of this now
-               omp_unset_lock(&nlocks[C[i]]); // Unlocking the cluster
-               */
-        } // End of if
-    } // End of for(j)
-    //displayHashMap(cluPtrIn[C[i]], sizeArr[C[i]]);
-#ifdef DEBUG_B
-    displayHashMap(cluPtrIn[C[i]], sizeArr[C[i]]);
-    printf("NE_self : %ld\n", NE_self);
-    printf("NE_out : %ld\n", NE_out);
-#endif
-    //free(temp);
-} // End of for(i)
-/*
-   for (long n = 0; n < NV_out; n++) {
-   displayHashMap(cluPtrIn[n], sizeArr[n]);
-   }
-   */
-// Prefix sum:
-for (long i = 0; i < NV_out; i++) {
-#ifdef DEBUG_B
-    printf("Prev : i : %ld vtxPtrOut[%ld] : %ld ", i, i, vtxPtrOut[i]);
-    printf("i+1 : %ld vtxPtrOut[%ld] : %ld ", i+1, i+1, vtxPtrOut[i+1]);
-#endif
-    vtxPtrOut[i+1] = vtxPtrOut[i+1] + vtxPtrOut[i];    
-#ifdef DEBUG_B
-    printf("New i : %ld vtxPtrOut[%ld] : %ld    ", i, i, vtxPtrOut[i]);
-    printf("New i+1 : %ld vtxPtrOut[%ld] : %ld\n", i+1, i+1, vtxPtrOut[i+1]);
-#endif
-}
-
-end = omp_get_wtime();
-totTime += (end - start);
-printf("NE_out=%ld  NE_self=%ld\n", NE_out, NE_self);
-printf("These should match: %ld == %ld\n", (2*NE_out+NE_self), vtxPtrOut[NV_out]);
-#ifdef DETAILED
-printf("Time to count edges: %3.3lf\n", (end - start));
-#endif
-assert(vtxPtrOut[NV_out] == (NE_out*2+NE_self)); // Sanity check
-
-start = omp_get_wtime();
-// Step 3 : build the edge list:
-long numEdges = vtxPtrOut[NV_out];
-long realEdges = NE_out + NE_self; // Self-loops appear once and others appear twice. How?
-edge* vtxIndOut = (edge*)malloc(numEdges * sizeof(edge));
-assert(vtxIndOut != 0);
-long *Added = (long*)malloc(NV_out * sizeof(long)); // Keep track of what got added
-assert(Added != 0);
-
-// Don't understand the point right now
-//#pragma omp parallel for 
-for (long i = 0; i < NV_out; i++) {
-    Added[i] = 0;
-}
-
-// Now add the edges in no particular order
-// Don't understand the point right now
-//#pragma omp parallel for
-dataItem* temp = (dataItem*)malloc(sizeof(dataItem));
-for (long i = 0; i < NV_out; i++) {
-#ifdef DEBUG_B
-    printf("i = %ld\n", i);
-#endif
-    long j = 0;
-    long Where;
-    temp = cluPtrIn[i][j];
-    //printf("i : %ld j : %ld\n",  i, j);
-    //printf("sizeArr[i] : %ld\n", sizeArr[i]);
-    //printf("temp->data : %ld\n", temp->data);
-    //displayHashMap(cluPtrIn[i], sizeArr[i]);
-    // Now go through the other edges
-    while (j < sizeArr[i]) {
-        // Don't understand the point of this right now
-        //Where = vtxPtrOut[i] + __sync_fetch_and_add(&Added[i], 1);
-        Where = vtxPtrOut[i] + Added[i]++;
-#ifdef DEBUG_B
-        printf("Where : %ld\n", Where);
-#endif
-        vtxIndOut[Where].head = i; // Head
-#ifdef DEBUG_B
-        printf("head : %ld\n", i);
-#endif
-        vtxIndOut[Where].tail = temp->key; // Tail
-#ifdef DEBUG_B
-        printf("tail : %ld\n", temp->key);
-#endif
-        vtxIndOut[Where].weight = temp->data; // Weight
-#ifdef DEBUG_B
-        printf("head : %ld  tail : %ld  weight : %ld\n", i, temp->key, temp->data);
-#endif
-        if (i != temp->key) {
-            // Don't understand the point of this now
-            //Where = vtxPtrOut[temp->key] + __sync_fetch_and_add(&Added[i], 1);
-            Where = vtxPtrOut[temp->key] + Added[temp->key]++;
-            vtxIndOut[Where].head = temp->key;
-            vtxIndOut[Where].tail = i; // Tail
-            vtxIndOut[Where].weight = temp->data; // Weight
-        }
-        j++;
-        temp = cluPtrIn[i][j];
-    } // End of while
-} // End of for(i)
-free(temp);
-
-end = omp_get_wtime();
-totTime += (end - start);
-#ifdef DETAILED
-printf("Time to build graph: %3.3lf\n", (end - start));
-printf("Total time: %3.3lf\n", totTime);
-#endif
-//printf("Total time to build next phase: %3.3lf\n", totTime);
-
-// Set the pointers
-Gout->numVertices = NV_out;
-Gout->sVertices = NV_out;
-// Note: Self-loops are represented ONCE, but others appear TWICE
-Gout->numEdges = realEdges; // Add self-loops to the #edges
-Gout->edgeListPtrs = vtxPtrOut;
-Gout->edgeList = vtxIndOut;
-
-// Clean up
-free(Added);
-// Don't understand the point of it right now
-//#pragma omp parallel for
-for (long i = 0; i < numUniqueClusters; i++) {
-    freeHashArr(cluPtrIn[i], sizeArr[i]);    
-}
-free(cluPtrIn);
-
-// Don't understand the point of it right now
-// #pragma omp parallel for
-/*
-   for (long i = 0; i < numUniqueClusters; i++) {
-   omp_destroy_lock(&nlocks[i]);
-   }
-   free(nlocks);
-   */
-
-return(totTime);
-} // End of buildNewGraphVF
+    free(tmp);
+} // End of partitionSeed
 
 // function : generateRandomNumbers
+// Each thread draws its block of the vector from its own RngStream
 void generateRandomNumbers(double* RandVec, long size) {
 #ifdef DETAILED
     printf("Inside generateRandomNumbers\n");
 #endif
-    int nT = 1;
-    // Don't understand the point of this right now
-    //int nT;
-    //#pragma omp parallel
-    //{
-    //  nT = omp_get_num_threads();
-    //}
-    //printf("Number of threads: %d\n", nT);
+    int nT = omp_get_max_threads();
 
     // Initialize parallel pseudo-random number generator
+    // The package seed is global: concurrent runs (-g sweeps) take turns
     unsigned long seed[6] = {1, 2, 3, 4, 5, 6};
-    RngStream_SetPackageSeed(seed);
     RngStream RngArray[nT]; //array of RngStream Objects
+    #pragma omp critical (rngStreamPackage)
+    {
+        RngStream_SetPackageSeed(seed);
+        for (int i = 0; i < nT; i++) {
+            RngArray[i] = RngStream_CreateStream("");
+        }
+    }
 
     long block = size/nT;
 #ifdef DETAILED
-    printf("Each thread will add %ld edges\n", block);
+    printf("Each thread will generate %ld numbers\n", block);
 #endif
 
-    // Each thread will generate m/nT edges each
-    //double start = omp_get_wtime();
-    //clock_t start = clock();
-
-    // Don't understand the point of this right now
-    // #pragma omp parallel
-    // {
-    //  int myRank = omp_get_thread_num();
-    //  #pragma omp for schedule(static)
-    //  for (long i = 0; i < size; i++) {
-    //      RandVec[i] = RndArray[myRank].RandU01();
-    //  }
-    // }
+    #pragma omp parallel num_threads(nT)
+    {
+        int myRank = omp_get_thread_num();
+        #pragma omp for schedule(static)
+        for (long i = 0; i < size; i++) {
+            RandVec[i] = RngStream_RandU01(RngArray[myRank]);
+        }
+    }
 
     for (int i = 0; i < nT; i++) {
-        RngArray[i] = RngStream_CreateStream("");
+        RngStream_DeleteStream(&RngArray[i]);
     }
-
-    int myRank = 0;
-    //printf("myRank=%d\n", myRank);
-    for (long i = 0; i < size; i++) {
-        //printf("i=%ld\n", i);
-        RandVec[i] = RngStream_RandU01(RngArray[myRank]);
-    } 
 } // End of generateRandomNumbers
 
 // function : algoDistanceOneVertexColoringOpt
+// Speculative coloring: color every queued vertex in parallel with the
+// smallest color not used by its neighbors, then detect conflicts in
+// parallel and queue one endpoint of each conflict for the next round.
+// Each thread keeps one forbidden-color buffer. A color c is forbidden for
+// v while Mark[c] == v, so the buffer never needs to be cleared; it grows
+// when a neighbor has a color beyond its end.
 int algoDistanceOneVertexColoringOpt(graph* G, int* vtxColor, int nThreads, double* totTime) {
 #ifdef DETAILED
     printf("Inside algoDistanceOneVertexColoringOpt\n");
 #endif
-    // Don't understand the point of this right now
-    /*
-       if (nThreads < 1) {
-       omp_set_num_threads(1); // default to one thread
-       } else {
-       omp_set_num_threads(nThreads);
-       }
-
-       int nT;
-#pragma omp parallel
-{
-nT = omp_get_num_threads();
-}
-printf("Actual number of threads: %d (requested: %d)\n", nT, nThreads);
-*/
-
     double start, end;
     double totalTime=0;
     // Get the iterators for the graph:
     long NVer = G->numVertices;
     long NEdge = G->numEdges;
     long* vtxPtr = G->edgeListPtrs; // vertex pointer: pointers to endV
-    edge* vtxInd = G->edgeList; // vertex index : destination id of an edge (src -> dest)
-    //printf("Vertices : %ld  Edges : %ld\n", NVer, NEdge);
+    vertexId* vtxInd = G->edgeList; // vertex index : destination id of an edge (src -> dest)
 
     // Build a vector of random numbers
     double* randValues = (double*)malloc(NVer * sizeof(double));
     assert(randValues != 0);
     generateRandomNumbers(randValues, NVer);
-    /*
-       for (long i = 0; i < NVer; i++) {
-       printf("i=%ld   %lf ", i, randValues[i]);
-       }
-       printf("\n");
-       */
 
-    long* Q = (long*)malloc(NVer * sizeof(long));
+    vertexId* Q = (vertexId*)malloc(NVer * sizeof(vertexId));
     assert(Q != 0);
-    long* Qtmp = (long*)malloc(NVer * sizeof(long));
+    vertexId* Qtmp = (vertexId*)malloc(NVer * sizeof(vertexId));
     assert(Qtmp != 0);
-    long* Qswap;
+    vertexId* Qswap;
     if ((Q == NULL) || (Qtmp == NULL)) {
         printf("Not enough memory to allocate two queues\n");
         exit(1);
     }
 
-long QTail = 0; // Tail of the queue
-long QtmpTail = 0; // Tail of the queue (implicitly will represent the size)
+    long QTail = 0; // Tail of the queue
+    long QtmpTail = 0; // Tail of the queue (implicitly will represent the size)
 
-// Don't understand the point of this right now
-// #pragma omp parallel for
-for (long i = 0; i < NVer; i++) {
-    Q[i] = i; // Natural order
-    Qtmp[i] = -1; // empty queue
-}
-QTail = NVer; // Queue all vertices
-//////////////////////////////////////////////////////////////////////////////
-////////////////// START THE WHILE LOOP //////////////////////////////////////
-//////////////////////////////////////////////////////////////////////////////
-long nConflicts = 0; // Number of conflicts
-int nLoops = 0; // Number of rounds of conflict resolution
+    #pragma omp parallel for
+    for (long i = 0; i < NVer; i++) {
+        Q[i] = i; // Natural order
+        Qtmp[i] = -1; // empty queue
+    }
+    QTail = NVer; // Queue all vertices
+
+    // One forbidden-color buffer per thread
+    int nT = omp_get_max_threads();
+    vertexId** threadMark = (vertexId**)malloc(nT * sizeof(vertexId*));
+    int* threadMarkSize = (int*)malloc(nT * sizeof(int));
+    assert((threadMark != 0) && (threadMarkSize != 0));
+    for (int t = 0; t < nT; t++) {
+        threadMark[t] = NULL;
+        threadMarkSize[t] = 0;
+    }
+    //////////////////////////////////////////////////////////////////////////////
+    ////////////////// START THE WHILE LOOP //////////////////////////////////////
+    //////////////////////////////////////////////////////////////////////////////
+    long nConflicts = 0; // Number of conflicts
+    int nLoops = 0; // Number of rounds of conflict resolution
 
 #ifdef DETAILED
-printf("Results from parallel coloring:\n");
-printf("***********************************\n");
+    printf("Results from parallel coloring:\n");
+    printf("***********************************\n");
 #endif
 
-do {
-    /////////////////////// PART 1 /////////////////////
-    // Color the vertices in parallel - do not worry about conflicts
+    do {
+        /////////////////////// PART 1 /////////////////////
+        // Color the vertices in parallel - do not worry about conflicts
 #ifdef DETAILED
-    printf("** Iteration : %d\n", nLoops);
+        printf("** Iteration : %d\n", nLoops);
 #endif
 
-    start = omp_get_wtime();
-    // Don't understand the point of this right now
-    //#pragma omp parallel for
-    for (long Qi = 0; Qi < QTail; Qi++) {
-        long v = Q[Qi]; // Q.pop_front();
-
-        long adj1 = vtxPtr[v];
-        long adj2 = vtxPtr[v+1];
-        long myDegree = adj2 - adj1;
-        bool* Mark = (bool*)malloc(MaxDegree * sizeof(bool));
-        assert(Mark != 0);
-
-        for (long i = 0; i < MaxDegree; i++) {
-            Mark[i] = false;
-        }
+        start = omp_get_wtime();
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (long Qi = 0; Qi < QTail; Qi++) {
+            vertexId v = Q[Qi]; // Q.pop_front();
+            int t = omp_get_thread_num();
+            vertexId* Mark = threadMark[t];
 
-        int maxColor = -1;
-        int adjColor = -1;
+            long adj1 = vtxPtr[v];
+            long adj2 = vtxPtr[v+1];
 
-        // Browse the adjacency set of vertex v
-        for (long k = adj1; k < adj2; k++) {
-            if (v == vtxInd[k].tail) { // Self-loops
-                continue;
-            }
-            adjColor = vtxColor[vtxInd[k].tail];
-            if (adjColor >= 0) {
-                assert(adjColor < MaxDegree);
-                Mark[adjColor] = true;
-                // Find the largest color in the neighborhood
-                if (adjColor > maxColor) {
-                    maxColor = adjColor;
+            // Browse the adjacency set of vertex v
+            for (long k = adj1; k < adj2; k++) {
+                if (v == vtxInd[k]) { // Self-loops
+                    continue;
                 }
-            }
-        } // End of for loop to traverse adjacency of v
+                int adjColor = vtxColor[vtxInd[k]];
+                if (adjColor >= 0) {
+                    if (adjColor >= threadMarkSize[t]) { // Grow the buffer
+                        int newSize = (adjColor+1 > 2*threadMarkSize[t]) ? adjColor+1 : 2*threadMarkSize[t];
+                        if (newSize < 64) {
+                            newSize = 64;
+                        }
+                        Mark = (vertexId*)realloc(Mark, newSize * sizeof(vertexId));
+                        assert(Mark != 0);
+                        for (int c = threadMarkSize[t]; c < newSize; c++) {
+                            Mark[c] = -1;
+                        }
+                        threadMark[t] = Mark;
+                        threadMarkSize[t] = newSize;
+                    }
+                    Mark[adjColor] = v;
+                }
+            } // End of for loop to traverse adjacency of v
 
-        int myColor;
-        for (myColor = 0; myColor <= maxColor; myColor++) {
-            if (Mark[myColor] == false) {
-                break;    
+            // Smallest color not forbidden for v
+            int myColor = 0;
+            while ((myColor < threadMarkSize[t]) && (Mark[myColor] == v)) {
+                myColor++;
             }
-        }
-
-        if (myColor == maxColor) {
-            myColor++; // no available color with # less then cmax
-        }
-
-        vtxColor[v] = myColor; // Color the vertex
+            vtxColor[v] = myColor; // Color the vertex
+        } // End of outer for loop : for each vertex
+        start = omp_get_wtime() - start;
+        totalTime += (start);
+#ifdef DETAILED
+        printf("Time taken for coloring: %lf sec.\n", start);
+#endif
 
-        free(Mark);
-    } // End of outer for loop : for each vertex
-    start = omp_get_wtime() - start;
-    totalTime += (start);
+        //////////////////////// PART 2 /////////////////////////
+        // Detect conflicts
 #ifdef DETAILED
-    printf("Time taken for coloring: %lf sec.\n", start);
+        printf("Phase 2 : Detect conflicts, add to Queue\n");
+#endif
+        // Add the conflicting vertices into a Q:
+        // Conflicts are resolved by changing the color of only one of 
+        // the two conflicting vertices, based on their random values
+        end = omp_get_wtime();
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (long Qi = 0; Qi < QTail; Qi++) {
+            vertexId v = Q[Qi]; // Q.pop_front();
+            long adj1 = vtxPtr[v];
+            long adj2 = vtxPtr[v+1];
+            // Browse the adjacency set of vertex v
+            for (long k = adj1; k < adj2; k++) {
+                vertexId w = vtxInd[k];
+                if (v == w) { // Self-loops
+                    continue;
+                }
+                if (vtxColor[v] == vtxColor[w]) {
+                    if ( (randValues[v] < randValues[w]) || 
+                            ( (randValues[v] == randValues[w]) && (v < w) ) ) {
+                        long whereInQ = __sync_fetch_and_add(&QtmpTail, 1);
+                        Qtmp[whereInQ] = v; // Add to the Queue
+                        vtxColor[v] = -1; // Will prevent v from being in conflict in another pairing
+                        break;
+                    } 
+                } // End of if (vtxColor[v] == vtxColor[w])
+            } // End of inner for loop: w in adj(v)
+        } // //End of outer for loop: for each vertex
+
+        end = omp_get_wtime() - end;
+        totalTime += (end);
+        nConflicts += QtmpTail;
+        nLoops++;
+#ifdef DETAILED
+        printf("Num conflicts : %ld\n", QtmpTail);
+        printf("Time for detection : %lf sec\n", (end));
 #endif
-    /*
-       for (int u = 0; u < NVer; u++) {
-       printf(" vtxColor[%ld] :: %ld,", u, vtxColor[u]);
-       }
-       printf("\n");
-       */
 
-    //////////////////////// PART 2 /////////////////////////
-    // Detect conflicts
+        // Swap the two queues:
+        Qswap = Q;
+        Q = Qtmp; // Q now points to the second vector
+        Qtmp = Qswap; 
+        QTail = QtmpTail; // Number of elements
+        QtmpTail = 0; // Symbolic emptying of the second queue
+    } while (QTail > 0);
+
+    // Check the number of colors used
+    int nColors = -1;
+    #pragma omp parallel for reduction(max:nColors)
+    for (long v = 0; v < NVer; v++) {
+        if (vtxColor[v] > nColors) {
+            nColors = vtxColor[v];
+        }
+    }
 #ifdef DETAILED
-    printf("Phase 2 : Detect conflicts, add to Queue\n");
+    printf("***************************************\n");
+    printf("Total number of colors used: %d\n", nColors);
+    printf("Number of conflicts overall: %ld\n", nConflicts);
+    printf("Number of rounds: %d\n", nLoops);
+    printf("Total time: %lf sec\n", totalTime);
+    printf("***************************************\n");
 #endif
-    // Add the conflicting vertices into a Q:
-    // Conflicts are resolved by changing the color of only one of 
-    // the two conflicting vertices, based on their random values
-    end = omp_get_wtime();
-    // Don't understand the point of this
-    // #pragma omp parallel for
-    for (long Qi = 0; Qi < QTail; Qi++) {
-        long v = Q[Qi]; // Q.pop_front();
+    *totTime = totalTime;
+    //////////////////////////////////////////////////////////////////
+    ////////////// VERIFY THE COLORS /////////////////////////////////
+    //////////////////////////////////////////////////////////////////
+    // Verify results and cleanup
+    long myConflicts = 0;
+    #pragma omp parallel for reduction(+:myConflicts)
+    for (long v = 0; v < NVer; v++) {
         long adj1 = vtxPtr[v];
         long adj2 = vtxPtr[v+1];
         // Browse the adjacency set of vertex v
         for (long k = adj1; k < adj2; k++) {
-            if (v == vtxInd[k].tail) { // Self-loops
-                continue;
+            if (v == vtxInd[k]) {
+                continue; // Self-loops
             }
-            if (vtxColor[v] == vtxColor[vtxInd[k].tail]) {
-                if ( (randValues[v] < randValues[vtxInd[k].tail]) || 
-                        ( (randValues[v] == randValues[vtxInd[k].tail]) && (v < vtxInd[k].tail) ) ) {
-                    //long whereInQ = __sync_fetch_and_add(&QtmpTail, 1);
-                    long whereInQ = QtmpTail;
-                    QtmpTail++;
-                    Qtmp[whereInQ] = v; // Add to the Queue
-                    vtxColor[v] = -1; // Will prevent v from being in conflict in another pairing
-                    break;
-                } 
-            } // End of if (vtxColor[v] == vtxColor[vtxInd[k].tail])
-        } // End of inner for loop: w in adj(v)
-    } // //End of outer for loop: for each vertex
-
-    end = omp_get_wtime() - end;
-    totalTime += (end);
-    nConflicts += QtmpTail;
-    nLoops++;
-#ifdef DETAILED
-    printf("Num conflicts : %ld\n", QtmpTail);
-    printf("Time for detection : %lf sec\n", (end));
-#endif
-
-    // Swap the two queues:
-    Qswap = Q;
-    Q = Qtmp; // Q now points to the second vector
-    Qtmp = Qswap; 
-    QTail = QtmpTail; // Number of elements
-    QtmpTail = 0; // Symbolic emptying of the second queue
-} while (QTail > 0);
-
-// Check the number of colors used
-int nColors = -1;
-for (long v = 0; v < NVer; v++) {
-    //printf(" vtxColor[%ld] : %ld,", v, vtxColor[v]);
-    if (vtxColor[v] > nColors) {
-        nColors = vtxColor[v];
+            if (vtxColor[v] == vtxColor[vtxInd[k]]) {
+                myConflicts++;
+            }
+        } //End of inner for loop: w in adj(v)
+    } //End of outer for loop: for each vertex
+    myConflicts = myConflicts / 2; // Have counted each conflict twice
+    if (myConflicts > 0) {
+        printf("Check - WARNING: Number of conflicts detected after resolution: %ld \n\n", myConflicts);
+    } else {
+        printf("Check - SUCCESS: No conflicts exist\n\n");
     }
-}
-#ifdef DETAILED
-printf("***************************************\n");
-printf("Total number of colors used: %d\n", nColors);
-printf("Number of conflicts overall: %ld\n", nConflicts);
-printf("Number of rounds: %d\n", nLoops);
-printf("Total time: %lf sec\n", totalTime);
-printf("***************************************\n");
-#endif
-*totTime = totalTime;
-//////////////////////////////////////////////////////////////////
-////////////// VERIFY THE COLORS /////////////////////////////////
-//////////////////////////////////////////////////////////////////
-// Verify results and cleanup
-int myConflicts = 0;
-// Don't understand the point of this right now
-// #pragma omp parallel for
-for (long v = 0; v < NVer; v++) {
-    long adj1 = vtxPtr[v];
-    long adj2 = vtxPtr[v+1];
-    // Browse the adjacency set of vertex v
-    for (long k = adj1; k < adj2; k++) {
-        if (v == vtxInd[k].tail) {
-            continue; // Self-loops
-        }
-        if (vtxColor[v] == vtxColor[vtxInd[k].tail]) {
-            //__sync_fetch_and_add(&myConflicts, 1); //increment the counter
-            myConflicts++;
-        }
-    } //End of inner for loop: w in adj(v)
-} //End of outer for loop: for each vertex
-myConflicts = myConflicts / 2; // Have counted each conflict twice
-if (myConflicts > 0) {
-    printf("Check - WARNING: Number of conflicts detected after resolution: %d \n\n", myConflicts);
-} else {
-    printf("Check - SUCCESS: No conflicts exist\n\n");
-}
-// Clean-up
-free(Q);
-free(Qtmp);
-free(randValues);
+    // Clean-up
+    for (int t = 0; t < nT; t++) {
+        free(threadMark[t]);
+    }
+    free(threadMark);
+    free(threadMarkSize);
+    free(Q);
+    free(Qtmp);
+    free(randValues);
 
-return nColors; // Return the number of colors used
+    return nColors; // Return the number of colors used
 }
 
-void sumVertexDegree(edge* vtxInd, long* vtxPtr, long* vDegree, long NV, comm* cInfo) {
-    //#pragma omp parallel for
+void sumVertexDegree(edgeWeight* vtxWt, long* vtxPtr, double* vDegree, long NV, comm* cInfo) {
+    #pragma omp parallel for
     for (long i=0; i<NV; i++) {
         long adj1 = vtxPtr[i];      //Begining
         long adj2 = vtxPtr[i+1];    //End
-        long totalWt = 0;
-        for(long j=adj1; j<adj2; j++) {
-            totalWt += (long)vtxInd[j].weight;
+        double totalWt = 0;
+        if (vtxWt == NULL) { // Unit weights: the degree is the row length
+            totalWt = adj2 - adj1;
+        } else {
+            for(long j=adj1; j<adj2; j++) {
+                totalWt += vtxWt[j];
+            }
         }
         vDegree[i] = totalWt;       //Degree of each node
-        cInfo[i].degree = totalWt;  //Initialize the community
-        cInfo[i].size = 1;
+        if (cInfo != NULL) {
+            cInfo[i].degree = totalWt;  //Initialize the community
+            cInfo[i].size = 1;
+        }
     }
 } //End of sumVertexDegree()
 
-double calConstantForSecondTerm(long* vDegree, long NV) {
-    long totalEdgeWeightTwice = 0;
-    //#pragma omp parallel
-    //{
-    long localWeight = 0;
-    //#pragma omp for
+// function : initSingletonClusters
+// cInfo as filled by sumVertexDegree, from degrees computed earlier
+void initSingletonClusters(const double* vDegree, long NV, comm* cInfo) {
+    #pragma omp parallel for
     for (long i=0; i<NV; i++) {
-        localWeight += vDegree[i];
-    }
-    //#pragma omp critical
-    //{
-    totalEdgeWeightTwice += localWeight; //Update the global weight
-    //}
-    //} // End the parallel region
-    return 1/(double)totalEdgeWeightTwice;
+        cInfo[i].degree = vDegree[i];
+        cInfo[i].size = 1;
+    }
+} //End of initSingletonClusters()
+
+double calConstantForSecondTerm(const double* vDegree, long NV) {
+    double totalEdgeWeightTwice = 0;
+    #pragma omp parallel
+    {
+        double localWeight = 0;
+        #pragma omp for
+        for (long i=0; i<NV; i++) {
+            localWeight += vDegree[i];
+        }
+        #pragma omp critical
+        {
+            totalEdgeWeightTwice += localWeight; //Update the global weight
+        }
+    } // End the parallel region
+    return 1/totalEdgeWeightTwice;
 } //End of calConstantForSecondTerm()
 
-void initCommAss(long* pastCommAss, long* currCommAss, long NV) {
-    //#pragma omp parallel for
+void initCommAss(vertexId* pastCommAss, vertexId* currCommAss, long NV) {
+    #pragma omp parallel for
     for (long i=0; i<NV; i++) {
         pastCommAss[i] = i; //Initialize each vertex to its cluster
         currCommAss[i] = i;
     }
 } //End of initCommAss()
 
-long buildLocalMapCounter(long adj1, long adj2, dataItem** clusterLocalMap,
-        double* Counter, edge* vtxInd, long* currCommAss, long me, long NV) {
-    long size = NV;
-    dataItem* temp = (dataItem*)malloc(sizeof(dataItem));
-    long numUniqueClusters = 1;
-    long selfLoop = 0;
+// function : seedCommAss
+// Start from the clusters in seed instead of singletons: the assignments take
+// seed and cInfo (as filled by sumVertexDegree) is rebuilt for those clusters
+void seedCommAss(const vertexId* seed, vertexId* pastCommAss, vertexId* currCommAss,
+        const double* vDegree, comm* cInfo, long NV) {
+    #pragma omp parallel for
+    for (long i=0; i<NV; i++) {
+        cInfo[i].size = 0;
+        cInfo[i].degree = 0;
+    }
+    #pragma omp parallel for
+    for (long i=0; i<NV; i++) {
+        pastCommAss[i] = seed[i];
+        currCommAss[i] = seed[i];
+        __sync_fetch_and_add(&cInfo[seed[i]].size, 1);
+        #pragma omp atomic
+        cInfo[seed[i]].degree += vDegree[i];
+    }
+} //End of seedCommAss()
+
+// function : partitionModularity
+// Modularity of the clusters C (ids below NV, -1 for none) of G at the given resolution
+double partitionModularity(graph* G, const vertexId* C, double resolution) {
+    long NV = G->numVertices;
+    long *vtxPtr = G->edgeListPtrs;
+    vertexId *vtxInd = G->edgeList;
+    edgeWeight *vtxWt = G->edgeWeights;
+    double* clusterDegree = (double*)malloc(NV * sizeof(double));
+    assert(clusterDegree != 0);
+    #pragma omp parallel for
+    for (long c=0; c<NV; c++) {
+        clusterDegree[c] = 0;
+    }
+    double internal = 0, total = 0;
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+:internal,total)
+    for (long i=0; i<NV; i++) {
+        double degree = 0;
+        for (long j=vtxPtr[i]; j<vtxPtr[i+1]; j++) {
+            double w = (vtxWt == NULL) ? 1 : vtxWt[j];
+            degree += w;
+            if ((C[i] >= 0) && (C[vtxInd[j]] == C[i])) {
+                internal += w;
+            }
+        }
+        total += degree;
+        if (C[i] >= 0) {
+            #pragma omp atomic
+            clusterDegree[C[i]] += degree;
+        }
+    }
+    double squares = 0;
+    #pragma omp parallel for reduction(+:squares)
+    for (long c=0; c<NV; c++) {
+        squares += clusterDegree[c] * clusterDegree[c];
+    }
+    free(clusterDegree);
+    return (internal / total) - resolution * squares / (total * total);
+} //End of partitionModularity()
+
+// struct : clusterMap
+// Per-thread map from the cluster ids of a vertex's neighbors to local
+// counters. The slot table is sized by the degree of the current vertex and
+// only the slots touched by the previous vertex are cleared, so building and
+// scanning the map costs O(degree) and nothing is allocated per vertex.
+typedef struct clusterMap {
+    long numSlots; /* slots in use for the current vertex, power of two */
+    long allocSlots; /* allocated length of slots */
+    int shift; /* 64 - log2(numSlots), for the multiplicative hash */
+    long numUnique; /* number of distinct clusters inserted */
+    long capacity; /* allocated length of keys, slotOf and Counter */
+    dataItem* slots; /* (cluster id, local index) pairs, key == -1 when empty */
+    vertexId* keys; /* cluster id of each local index */
+    long* slotOf; /* slot occupied by each local index */
+    double* Counter; /* edge weight incident on each local index */
+} clusterMap;
+
+// function : initClusterMap
+void initClusterMap(clusterMap* map) {
+    map->numSlots = 0;
+    map->allocSlots = 0;
+    map->shift = 64;
+    map->numUnique = 0;
+    map->capacity = 0;
+    map->slots = NULL;
+    map->keys = NULL;
+    map->slotOf = NULL;
+    map->Counter = NULL;
+}
+
+// function : freeClusterMap
+void freeClusterMap(clusterMap* map) {
+    free(map->slots);
+    free(map->keys);
+    free(map->slotOf);
+    free(map->Counter);
+    initClusterMap(map);
+}
+
+// function : resetClusterMap
+// Empty the map and size it for a vertex with the given degree
+void resetClusterMap(clusterMap* map, long degree) {
+    long needed = degree + 1; // Every neighbor plus the vertex's own cluster
+    // Clear only the slots used by the previous vertex
+    for (long k = 0; k < map->numUnique; k++) {
+        map->slots[map->slotOf[k]].key = -1;
+    }
+    map->numUnique = 0;
+
+    if (needed > map->capacity) {
+        long capacity = (needed > 2*map->capacity) ? needed : 2*map->capacity;
+        free(map->keys);
+        free(map->slotOf);
+        free(map->Counter);
+        map->keys = (vertexId*)malloc(capacity * sizeof(vertexId));
+        map->slotOf = (long*)malloc(capacity * sizeof(long));
+        map->Counter = (double*)malloc(capacity * sizeof(double));
+        assert((map->keys != 0) && (map->slotOf != 0) && (map->Counter != 0));
+        map->capacity = capacity;
+    }
+
+    // Keep the load factor at or below one half
+    long numSlots = 2;
+    int bits = 1;
+    while (numSlots < 2*needed) {
+        numSlots <<= 1;
+        bits++;
+    }
+    if (numSlots > map->allocSlots) {
+        free(map->slots);
+        map->slots = (dataItem*)malloc(numSlots * sizeof(dataItem));
+        assert(map->slots != 0);
+        for (long k = 0; k < numSlots; k++) {
+            map->slots[k].key = -1;
+        }
+        map->allocSlots = numSlots;
+    }
+    map->numSlots = numSlots;
+    map->shift = 64 - bits;
+}
+
+// function : clusterMapAdd
+// Add weight to the counter of cluster key, inserting key if it is new
+void clusterMapAdd(clusterMap* map, vertexId key, double weight) {
+    long mask = map->numSlots - 1;
+    long h = (long)(((unsigned long)key * 0x9E3779B97F4A7C15UL) >> map->shift);
+    while (map->slots[h].key != -1) {
+        if (map->slots[h].key == key) {
+            map->Counter[map->slots[h].data] += weight;
+            return;
+        }
+        h = (h + 1) & mask; // Linear probing
+    }
+    vertexId local = map->numUnique++;
+    map->slots[h].key = key;
+    map->slots[h].data = local;
+    map->keys[local] = key;
+    map->slotOf[local] = h;
+    map->Counter[local] = weight;
+}
+
+double buildLocalMapCounter(long adj1, long adj2, clusterMap* map,
+        vertexId* vtxInd, edgeWeight* vtxWt, vertexId* currCommAss, vertexId me) {
+    double selfLoop = 0;
+    if (vtxWt == NULL) { // Unit weights: count the edges, no weight loads
+        for(long j=adj1; j<adj2; j++) {
+            if(vtxInd[j] == me) {  // SelfLoop need to be recorded
+                selfLoop++;
+            }
+            clusterMapAdd(map, currCommAss[vtxInd[j]], 1); //Increment the counter by one
+        } //End of for(j)
+        return selfLoop;
+    }
     for(long j=adj1; j<adj2; j++) {
-        if(vtxInd[j].tail == me) {  // SelfLoop need to be recorded
-            selfLoop += (long)vtxInd[j].weight;
-        }
-        temp = search(currCommAss[vtxInd[j].tail], size, clusterLocalMap); // check if it already exists
-        if (temp != NULL) { // Already exists
-            //printf("I am here\n");
-            //printf("temp->data : %ld ,  Counter[temp->data] : %lf\n",  temp->data,Counter[temp->data]);
-            //printf("vtxInd[j].weight : %lf\n", vtxInd[j].weight);
-            Counter[temp->data] += vtxInd[j].weight; //Increment the counter with weight
-            //printf("temp->data : %ld ,  Counter[temp->data] : %lf\n",  temp->data,Counter[temp->data]);
-        } else {
-            insert(currCommAss[vtxInd[j].tail], numUniqueClusters, size, clusterLocalMap); // Doesn't exist, add to the map
-            Counter[numUniqueClusters] = vtxInd[j].weight;
-            numUniqueClusters++;
+        if(vtxInd[j] == me) {  // SelfLoop need to be recorded
+            selfLoop += vtxWt[j];
         }
+        clusterMapAdd(map, currCommAss[vtxInd[j]], vtxWt[j]); //Increment the counter with weight
     } //End of for(j)
-    //printf("returning %lf\n", Counter[0]);
-    //printf("returning %ld\n", (long)Counter[0]);
-    //printf("returing selfloop : %ld\n", selfLoop);
     return selfLoop;
 } //End of buildLocalMapCounter()
 
-long max(dataItem** clusterLocalMap, double* Counter,
-        long selfLoop, comm* cInfo, long degree, long sc, double constant, long size) {
-    dataItem* temp = (dataItem*)malloc(sizeof(dataItem));
-    long maxIndex = sc;   //Assign the initial value as self community
+// Local index 0 of the map always holds the vertex's own cluster sc
+// The null-model term is scaled by the resolution: above 1 favors smaller clusters
+vertexId max(clusterMap* map, double selfLoop, comm* cInfo, double degree, vertexId sc, double constant,
+        double resolution) {
+    vertexId maxIndex = sc;   //Assign the initial value as self community
     double curGain = 0;
     double maxGain = 0;
-    double eix = Counter[0] - selfLoop;
+    double eix = map->Counter[0] - selfLoop;
     double ax = cInfo[sc].degree - degree;
     double eiy = 0;
     double ay = 0;
 
-    long j = 0;
-    temp = clusterLocalMap[0];
-    //displayHashMap(clusterLocalMap, size);
-    //printf("I am sc : %ld\n", sc);
-    while (j < size) {
-        if(temp != NULL && sc != temp->key) {
-            ay = cInfo[temp->key].degree; // degree of cluster y
-            eiy = Counter[temp->data];     //Total edges incident on cluster y
-            curGain = 2*(eiy - eix) - 2*degree*(ay - ax)*constant;
-            if( (curGain > maxGain) || ((curGain==maxGain) && (curGain != 0) 
-                        && (temp->key < maxIndex)) ) {
-                maxGain = curGain;
-                maxIndex = temp->key;
-            }
-        }
-        j++;
-        temp = clusterLocalMap[j];
-    } // End of while
+    for (long k = 1; k < map->numUnique; k++) {
+        vertexId y = map->keys[k];
+        ay = cInfo[y].degree; // degree of cluster y
+        eiy = map->Counter[k];     //Total edges incident on cluster y
+        curGain = 2*(eiy - eix) - 2*resolution*degree*(ay - ax)*constant;
+        if( (curGain > maxGain) || ((curGain==maxGain) && (curGain != 0) 
+                    && (y < maxIndex)) ) {
+            maxGain = curGain;
+            maxIndex = y;
+        }
+    } // End of for(k)
 
     if(cInfo[maxIndex].size == 1 && cInfo[sc].size ==1 && maxIndex > sc) { //Swap protection
         maxIndex = sc;
@@ -1604,8 +3764,55 @@ long max(dataItem** clusterLocalMap, double* Counter,
     return maxIndex;
 } //End max()
 
-double parallelLouvianMethod(graph *G, long *C, int nThreads, double Lower,
-        double thresh, double *totTime, int *numItr) {
+// function : compactActiveSet
+// Gather the vertices whose flag is set into list, in increasing order;
+// returns their number. Each thread compacts one contiguous range.
+long compactActiveSet(const unsigned char* flag, long NV, vertexId* list) {
+    int nT = omp_get_max_threads();
+    long* offset = (long*)malloc((nT+1) * sizeof(long));
+    assert(offset != 0);
+    offset[0] = 0;
+    int team = nT; //Threads the region really got (may be fewer than nT)
+    #pragma omp parallel num_threads(nT)
+    {
+        int t = omp_get_thread_num();
+        int nth = omp_get_num_threads();
+        long begin = NV * t / nth;
+        long end = NV * (t+1) / nth;
+        long count = 0;
+        for (long i = begin; i < end; i++) {
+            count += flag[i];
+        }
+        offset[t+1] = count;
+        #pragma omp barrier
+        #pragma omp single
+        {
+            team = nth;
+            for (int k = 0; k < nth; k++) {
+                offset[k+1] += offset[k];
+            }
+        }
+        long Where = offset[t];
+        for (long i = begin; i < end; i++) {
+            if (flag[i]) {
+                list[Where++] = i;
+            }
+        }
+    }
+    long numActive = offset[team];
+    free(offset);
+    return numActive;
+} // End of compactActiveSet
+
+// function : parallelLouvianMethod
+// With pruneInactive, an iteration only re-evaluates the vertices that moved
+// in the previous iteration and their neighbors (the active set); every other
+// vertex keeps its cluster and its cached clusterWeightInternal, which cannot
+// have changed since neither it nor any neighbor moved.
+// With seed != NULL the vertices start in the clusters of seed.
+double parallelLouvianMethod(graph *G, vertexId *C, int nThreads, double Lower,
+        double thresh, double *totTime, int *numItr, bool pruneInactive, const vertexId* seed,
+        double resolution, const double* sharedDegree, const unsigned char* startActive) {
 #ifdef DETAILED
     printf("Within parallelLouvianMethod()\n");
 #endif
@@ -1617,10 +3824,10 @@ double parallelLouvianMethod(graph *G, long *C, int nThreads, double Lower,
        }
        */
     int nT;
-    //#pragma omp parallel
-    //{
-    nT = omp_get_num_threads();
-    //}
+    #pragma omp parallel
+    {
+        nT = omp_get_num_threads();
+    }
 #ifdef DETAILED
     printf("Actual number of threads: %d (requested: %d)\n", nT, nThreads);
 #endif
@@ -1630,10 +3837,10 @@ double parallelLouvianMethod(graph *G, long *C, int nThreads, double Lower,
     long    NS        = G->sVertices;  
     long    NE        = G->numEdges;
     long    *vtxPtr   = G->edgeListPtrs;
-    edge    *vtxInd   = G->edgeList;
+    vertexId *vtxInd  = G->edgeList;
+    edgeWeight *vtxWt = G->edgeWeights;
 
     /* Variables for computing modularity */
-    long totalEdgeWeightTwice;
     double constantForSecondTerm;
     double prevMod=-1;
     double currMod=-1;
@@ -1643,38 +3850,92 @@ double parallelLouvianMethod(graph *G, long *C, int nThreads, double Lower,
 
     /********************** Initialization **************************/
     time1 = omp_get_wtime();
-    //Store the degree of all vertices
-    long* vDegree = (long *) malloc (NV * sizeof(long)); 
-    assert(vDegree != 0);
     //Community info. (ai and size)
     comm *cInfo = (comm *) malloc (NV * sizeof(comm)); 
     assert(cInfo != 0);
+    //Store the degree of all vertices (or use the degrees shared by concurrent runs)
+    double* vDegree = (double *) sharedDegree;
+    if (sharedDegree == NULL) {
+        vDegree = (double *) malloc (NV * sizeof(double)); 
+        assert(vDegree != 0);
+    }
     //use for updating Community
     comm *cUpdate = (comm*)malloc(NV*sizeof(comm)); 
     assert(cUpdate != 0);
     //use for Modularity calculation (eii)
-    long* clusterWeightInternal = (long*) malloc (NV*sizeof(long)); 
+    double* clusterWeightInternal = (double*) malloc (NV*sizeof(double)); 
     assert(clusterWeightInternal != 0);
     float* clusterWeightInternalDouble = (float*)malloc(NV * sizeof(float));
     assert(clusterWeightInternalDouble != 0);
     float* cInfoDouble = (float*)malloc(NV * sizeof(float));
     assert(cInfoDouble != 0);
-    sumVertexDegree(vtxInd, vtxPtr, vDegree, NV , cInfo); // Sum up the vertex degree
+    if (sharedDegree == NULL) {
+        sumVertexDegree(vtxWt, vtxPtr, vDegree, NV , cInfo); // Sum up the vertex degree
+    } else {
+        initSingletonClusters(vDegree, NV, cInfo);
+    }
     /*** Compute the total edge weight (2m) and 1/2m ***/
     constantForSecondTerm = calConstantForSecondTerm(vDegree, NV); // 1 over sum of the degree
     //Community assignments:
     //Store previous iteration's community assignment
-    long* pastCommAss = (long *) malloc (NV * sizeof(long)); 
+    vertexId* pastCommAss = (vertexId *) malloc (NV * sizeof(vertexId)); 
     assert(pastCommAss != 0);
     //Store current community assignment
-    long* currCommAss = (long *) malloc (NV * sizeof(long)); 
+    vertexId* currCommAss = (vertexId *) malloc (NV * sizeof(vertexId)); 
     assert(currCommAss != 0);
     //Store the target of community assignment
-    long* targetCommAss = (long *) malloc (NV * sizeof(long)); 
+    vertexId* targetCommAss = (vertexId *) malloc (NV * sizeof(vertexId)); 
     assert(targetCommAss != 0);
+    //One reusable neighbor-cluster map per thread
+    int nMaps = omp_get_max_threads();
+    clusterMap* threadMaps = (clusterMap*)malloc(nMaps * sizeof(clusterMap));
+    assert(threadMaps != 0);
+    for (int t = 0; t < nMaps; t++) {
+        initClusterMap(&threadMaps[t]);
+    }
+    //Active set: flags of the next iteration and the list of the current one
+    unsigned char* activeFlag = NULL;
+    vertexId* activeList = NULL;
+    long numActive = NV; // All vertices are evaluated in the first iteration
+    pruneInactive = pruneInactive || (startActive != NULL);
+    if (pruneInactive) {
+        activeFlag = (unsigned char*)malloc(NV * sizeof(unsigned char));
+        assert(activeFlag != 0);
+        activeList = (vertexId*)malloc(NV * sizeof(vertexId));
+        assert(activeList != 0);
+        if (startActive != NULL) { // Only the flagged vertices (incremental mode)
+            numActive = compactActiveSet(startActive, NV, activeList);
+        } else {
+            #pragma omp parallel for
+            for (long i=0; i<NV; i++) {
+                activeList[i] = i;
+            }
+        }
+    }
 
     //Initialize each vertex to its own cluster
     initCommAss(pastCommAss, currCommAss, NV);
+    if (seed != NULL) {
+        seedCommAss(seed, pastCommAss, currCommAss, vDegree, cInfo, NV);
+    }
+    //e_ix is only rewritten for evaluated vertices (isolated ones stay at 0)
+    #pragma omp parallel for
+    for (long i=0; i<NV; i++) {
+        clusterWeightInternal[i] = 0;
+    }
+    //Only part of the vertices is evaluated at first: take e_ix of the others from the seed
+    if (startActive != NULL) {
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (long i=0; i<NV; i++) {
+            double eix = 0;
+            for (long j=vtxPtr[i]; j<vtxPtr[i+1]; j++) {
+                if (currCommAss[vtxInd[j]] == currCommAss[i]) {
+                    eix += (vtxWt == NULL) ? 1 : vtxWt[j];
+                }
+            }
+            clusterWeightInternal[i] = eix;
+        }
+    }
 
     time2 = omp_get_wtime();
     printf("Time to initialize: %3.3lf\n", time2-time1);
@@ -1696,74 +3957,59 @@ double parallelLouvianMethod(graph *G, long *C, int nThreads, double Lower,
         numItrs++;
         time1 = omp_get_wtime();
         /* Re-initialize datastructures */
-        //#pragma omp parallel for
+        #pragma omp parallel for
         for (long i=0; i<NV; i++) {
-            clusterWeightInternal[i] = 0;
             cUpdate[i].degree =0;
             cUpdate[i].size =0;
+            if (pruneInactive) {
+                targetCommAss[i] = currCommAss[i]; //Inactive vertices stay
+            }
+        }
+        if (pruneInactive) {
+            printf("Iteration %d: %ld active vertices (%3.2lf%%)\n", numItrs, numActive,
+                    100.0*numActive/NV);
         }
 
-        //#pragma omp parallel for
-        for (long i=0; i<NV; i++) {
+        //Each thread owns a slice of the vertices; cInfo and currCommAss are read-only here
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (long k=0; k<numActive; k++) {
+            long i = pruneInactive ? activeList[k] : k;
             long adj1 = vtxPtr[i];
             long adj2 = vtxPtr[i+1];
-            long selfLoop = 0;
-            long size = NV;
-            //Build a datastructure to hold the cluster structure of its neighbors
-            dataItem** clusterLocalMap;
-            //vector<double> Counter;
-            //Number of edges to each unique cluster
-            double* Counter;
-            if (size != 0) {
-                clusterLocalMap = (dataItem**)malloc(size * sizeof(dataItem*));
-                for (long o = 0; o < size; o++) {
-                    clusterLocalMap[o] = NULL;
-                }
-                Counter = (double*)malloc(size * sizeof(double));
-            }
-            //map<long, long>::iterator storedAlready;
-            dataItem* temp = (dataItem*)malloc(sizeof(dataItem));
+            double selfLoop = 0;
+            //Map each neighbor's cluster to a local counter (edges incident, eicj)
+            clusterMap* map = &threadMaps[omp_get_thread_num()];
             if(adj1 != adj2) {
-                //Add v's current cluster:
-                insert(currCommAss[i], (long)0, size, clusterLocalMap);
-                Counter[0] = 0; //Initialize the counter to ZERO (no edges incident yet)
+                resetClusterMap(map, adj2 - adj1);
+                //Add v's current cluster with no edges incident yet:
+                clusterMapAdd(map, currCommAss[i], 0);
                 //Find unique cluster ids and #of edges incident (eicj) to them
-                selfLoop = buildLocalMapCounter(adj1, adj2, clusterLocalMap, Counter, vtxInd, currCommAss, i, NV);
-                // Update delta Q calculation
-                //printf("got %lf\n", Counter[0]);
-                //printf("clusterWeightInternal[i] %ld\n", clusterWeightInternal[i]);
-                clusterWeightInternal[i] += (long)Counter[0]; //(e_ix)
-                //printf("clusterWeightInternal[i], i : %ld, %ld\n", clusterWeightInternal[i], i);
+                selfLoop = buildLocalMapCounter(adj1, adj2, map, vtxInd, vtxWt, currCommAss, i);
+                // Update delta Q calculation (per vertex, summed per thread below)
+                clusterWeightInternal[i] = map->Counter[0]; //(e_ix)
                 //Calculate the max
-                targetCommAss[i] = max(clusterLocalMap, Counter, selfLoop, cInfo, vDegree[i], currCommAss[i], constantForSecondTerm, size);
+                targetCommAss[i] = max(map, selfLoop, cInfo, vDegree[i], currCommAss[i], constantForSecondTerm,
+                        resolution);
             } else {
                 targetCommAss[i] = -1;
             }
 
             //Update
             if(targetCommAss[i] != currCommAss[i]  && targetCommAss[i] != -1) {
-                //printf("I am here uouo\n");
-                //printf("Inside here, targetCommAss[i] : %ld\n", targetCommAss[i]);
-                //printf("cUpdate[targetCommAss[i]].degree : %ld, vDegree[i] : %ld\n", cUpdate[targetCommAss[i]].degree, vDegree[i]);
-                //__sync_fetch_and_add(&cUpdate[targetCommAss[i]].degree, vDegree[i]);
+                #pragma omp atomic
                 cUpdate[targetCommAss[i]].degree += vDegree[i];
-                //printf("cUpdate[targetCommAss[i]].degree : %ld, vDegree[i] : %ld\n", cUpdate[targetCommAss[i]].degree, vDegree[i]);
-                //__sync_fetch_and_add(&cUpdate[targetCommAss[i]].size, 1);
-                cUpdate[targetCommAss[i]].size += 1;
-                //__sync_fetch_and_sub(&cUpdate[currCommAss[i]].degree, vDegree[i]);
-                cUpdate[currCommAss[i]].degree = cUpdate[currCommAss[i]].degree - vDegree[i];
-                //__sync_fetch_and_sub(&cUpdate[currCommAss[i]].size, 1);
-                cUpdate[currCommAss[i]].size = cUpdate[currCommAss[i]].size - 1;
+                __sync_fetch_and_add(&cUpdate[targetCommAss[i]].size, 1);
+                #pragma omp atomic
+                cUpdate[currCommAss[i]].degree -= vDegree[i];
+                __sync_fetch_and_sub(&cUpdate[currCommAss[i]].size, 1);
             } //End of If()
-
-            freeHashArr(clusterLocalMap, size);
-            free(Counter);
         }
 
         time2 = omp_get_wtime();
 
         time3 = omp_get_wtime();
 
+        #pragma omp parallel for
         for (long i = 0; i < NV; i++) {
             clusterWeightInternalDouble[i] = (float)clusterWeightInternal[i] * (float)constantForSecondTerm;
             cInfoDouble[i] = (float)cInfo[i].degree * (float)constantForSecondTerm;
@@ -1774,7 +4020,7 @@ double parallelLouvianMethod(graph *G, long *C, int nThreads, double Lower,
         float modSum = 0;
         #pragma omp parallel for reduction(+:modSum)
         for (long i=0; i<NV; i++) {
-            modSum += clusterWeightInternalDouble[i] - cInfoDouble[i]*cInfoDouble[i]; 
+            modSum += clusterWeightInternalDouble[i] - (float)resolution*cInfoDouble[i]*cInfoDouble[i]; 
             //e_xx += (double)clusterWeightInternal[i];
             //a2_x += (cInfo[i].degree)*(cInfo[i].degree);
         }
@@ -1791,6 +4037,11 @@ double parallelLouvianMethod(graph *G, long *C, int nThreads, double Lower,
         printf("%d \t %g \t %g \t %lf \t %3.3lf \t %3.3lf  \t %3.3lf\n",numItrs, e_xx, a2_x, currMod, (time2-time1), (time4-time3), totItr );
 #endif
         //printf("%d \t %lf \t %3.3lf  \t %3.3lf\n",numItrs, currMod, totItr, total);
+        if ((startActive != NULL) && (seed != NULL) && (numItrs == 1)) {
+            //Check: the first iteration scores the seed partition itself
+            printf("Start modularity: %lf (seed partition: %lf)\n", currMod,
+                    partitionModularity(G, seed, resolution));
+        }
 
         //Break if modularity gain is not sufficient
         if((currMod - prevMod) < thresMod) {
@@ -1802,15 +4053,32 @@ double parallelLouvianMethod(graph *G, long *C, int nThreads, double Lower,
         if(prevMod < Lower) {
             prevMod = Lower;
         }
-        //#pragma omp parallel for
+        #pragma omp parallel for
         for (long i=0; i<NV; i++) {
             //printf("cInfo[i].size , cInfo[i].degree : %ld, %ld\n", cInfo[i].size, cInfo[i].degree);
             cInfo[i].size += cUpdate[i].size;
             cInfo[i].degree += cUpdate[i].degree;
+            if (pruneInactive) {
+                activeFlag[i] = 0;
+            }
+        }
+        //Next active set: every vertex that moved and its neighbors
+        if (pruneInactive) {
+            #pragma omp parallel for schedule(dynamic, 1024)
+            for (long k=0; k<numActive; k++) {
+                long i = activeList[k];
+                if ((targetCommAss[i] != currCommAss[i]) && (targetCommAss[i] != -1)) {
+                    activeFlag[i] = 1;
+                    for (long j=vtxPtr[i]; j<vtxPtr[i+1]; j++) {
+                        activeFlag[vtxInd[j]] = 1; //Racing writers all store 1
+                    }
+                }
+            }
+            numActive = compactActiveSet(activeFlag, NV, activeList);
         }
 
         //Do pointer swaps to reuse memory:
-        long* tmp;
+        vertexId* tmp;
         tmp = pastCommAss;
         pastCommAss = currCommAss; //Previous holds the current
         currCommAss = targetCommAss; //Current holds the chosen assignment
@@ -1829,7 +4097,7 @@ double parallelLouvianMethod(graph *G, long *C, int nThreads, double Lower,
 
     //Store back the community assignments in the input variable:
     //Note: No matter when the while loop exits, we are interested in the previous assignment
-    //#pragma omp parallel for
+    #pragma omp parallel for
     for (long i=0; i<NV; i++) {
         C[i] = pastCommAss[i];
     }
@@ -1838,18 +4106,27 @@ double parallelLouvianMethod(graph *G, long *C, int nThreads, double Lower,
     free(pastCommAss);
     free(currCommAss);
     free(targetCommAss);
-    free(vDegree);
+    if (sharedDegree == NULL) {
+        free(vDegree);
+    }
     free(cInfo);
     free(cUpdate);
     free(clusterWeightInternal);
     free(clusterWeightInternalDouble);
     free(cInfoDouble);
+    free(activeFlag);
+    free(activeList);
+    for (int t = 0; t < nMaps; t++) {
+        freeClusterMap(&threadMaps[t]);
+    }
+    free(threadMaps);
 
     return prevMod;
 }
 
-double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* color,
-        int numColor, double Lower, double thresh, double *totTime, int *numItr) {
+double algoLouvainWithDistOneColoring(graph* G, vertexId *C, int nThreads, int* color,
+        int numColor, double Lower, double thresh, double *totTime, int *numItr, const vertexId* seed,
+        double resolution, const double* sharedDegree) {
 #ifdef DETAILED
     printf("Within algoLouvainWithDistOneColoring()\n");
 #endif
@@ -1862,10 +4139,10 @@ double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* colo
        */
 
     int nT;
-    //#pragma omp parallel
-    //{
-    nT = omp_get_num_threads();
-    //}
+    #pragma omp parallel
+    {
+        nT = omp_get_num_threads();
+    }
 #ifdef DETAILED
     printf("Actual number of threads: %d (requested: %d)\n", nT, nThreads);
 #endif
@@ -1873,10 +4150,10 @@ double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* colo
     double time1, time2, time3, time4; //For timing purposes
     double total = 0, totItr = 0;
     /* Indexs are vertex */
-    long* pastCommAss;      //Store previous iteration's community assignment
-    long* currCommAss;      //Store current community assignment
-    //long* targetCommAss;  //Store the target of community assignment
-    long* vDegree;  //Store each vertex's degree
+    vertexId* pastCommAss;      //Store previous iteration's community assignment
+    vertexId* currCommAss;      //Store current community assignment
+    //vertexId* targetCommAss;  //Store the target of community assignment
+    double* vDegree;  //Store each vertex's degree
     float* clusterWeightInternal;//use for Modularity calculation (eii)
 
     /* Indexs are community */
@@ -1888,10 +4165,10 @@ double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* colo
     long    NS        = G->sVertices;
     long    NE        = G->numEdges;
     long    *vtxPtr   = G->edgeListPtrs;
-    edge    *vtxInd   = G->edgeList;
+    vertexId *vtxInd  = G->edgeList;
+    edgeWeight *vtxWt = G->edgeWeights;
 
     /* Modularity Needed variables */
-    long totalEdgeWeightTwice;
     double constantForSecondTerm;
     double prevMod=Lower;
     double currMod=-1;
@@ -1900,19 +4177,24 @@ double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* colo
 
     /********************** Initialization **************************/
     time1 = omp_get_wtime();
-    vDegree = (long *) malloc (NV * sizeof(long)); 
-    assert(vDegree != 0);
     cInfo = (comm *) malloc (NV * sizeof(comm)); 
     assert(cInfo != 0);
     cUpdate = (comm*)malloc(NV*sizeof(comm)); 
     assert(cUpdate != 0);
     float* cInfoDouble = (float*)malloc(NV * sizeof(float));
 
-    sumVertexDegree(vtxInd, vtxPtr, vDegree, NV , cInfo);   // Sum up the vertex degree
+    if (sharedDegree == NULL) {
+        vDegree = (double *) malloc (NV * sizeof(double)); 
+        assert(vDegree != 0);
+        sumVertexDegree(vtxWt, vtxPtr, vDegree, NV , cInfo);   // Sum up the vertex degree
+    } else {
+        vDegree = (double *) sharedDegree; // Computed once for concurrent runs
+        initSingletonClusters(vDegree, NV, cInfo);
+    }
     /*** Compute the total edge weight (2m) and 1/2m ***/
     constantForSecondTerm = calConstantForSecondTerm(vDegree, NV);  // 1 over sum of the degree
 
-    pastCommAss = (long *) malloc (NV * sizeof(long)); 
+    pastCommAss = (vertexId *) malloc (NV * sizeof(vertexId)); 
     assert(pastCommAss != 0);
     //Community provided as input:
     currCommAss = C; 
@@ -1920,40 +4202,48 @@ double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* colo
 
     /*** Assign each vertex to its own Community ***/
     initCommAss( pastCommAss, currCommAss, NV);
+    if (seed != NULL) {
+        seedCommAss(seed, pastCommAss, currCommAss, vDegree, cInfo, NV);
+    }
 
     clusterWeightInternal = (float*) malloc (NV*sizeof(float)); 
     assert(clusterWeightInternal != 0);
+    //One reusable neighbor-cluster map per thread
+    int nMaps = omp_get_max_threads();
+    clusterMap* threadMaps = (clusterMap*)malloc(nMaps * sizeof(clusterMap));
+    assert(threadMaps != 0);
+    for (int t = 0; t < nMaps; t++) {
+        initClusterMap(&threadMaps[t]);
+    }
 
     /*** Create a CSR-like datastructure for vertex-colors ***/
     long * colorPtr = (long *) malloc ((numColor+1) * sizeof(long));
-    long * colorIndex = (long *) malloc (NV * sizeof(long));
+    vertexId * colorIndex = (vertexId *) malloc (NV * sizeof(vertexId));
     long * colorAdded = (long *)malloc (numColor*sizeof(long));
     assert(colorPtr != 0);
     assert(colorIndex != 0);
     assert(colorAdded != 0);
     // Initialization
-    //#pragma omp parallel for
+    #pragma omp parallel for
     for(long i = 0; i < numColor; i++) { 
         colorPtr[i] = 0;
         colorAdded[i] = 0;
     }
     colorPtr[numColor] = 0;
     // Count the size of each color
-    //#pragma omp parallel for
+    #pragma omp parallel for
     for(long i = 0; i < NV; i++) {
-        //__sync_fetch_and_add(&colorPtr[(long)color[i]+1],1);
-        colorPtr[(long)color[i]+1]++;
+        __sync_fetch_and_add(&colorPtr[(long)color[i]+1],1);
     }
     //Prefix sum:
     for(long i=0; i<numColor; i++) {
         colorPtr[i+1] += colorPtr[i];
     }
-    //Group vertices with the same color in particular order
-    //#pragma omp parallel for
+    //Group vertices with the same color in no particular order
+    #pragma omp parallel for
     for (long i=0; i<NV; i++) {
         long tc = (long)color[i];
-        long Where = colorPtr[tc] + colorAdded[tc]++; 
-        //long Where = colorPtr[tc] + __sync_fetch_and_add(&(colorAdded[tc]), 1);
+        long Where = colorPtr[tc] + __sync_fetch_and_add(&(colorAdded[tc]), 1);
         colorIndex[Where] = i;
     }
     time2 = omp_get_wtime();
@@ -1977,7 +4267,7 @@ double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* colo
         numItrs++;
         time1 = omp_get_wtime();
         for( long ci = 0; ci < numColor; ci++) {// Begin of color loop
-            //#pragma omp parallel for
+            #pragma omp parallel for
             for (long i=0; i<NV; i++) {
                 //printf("processing i = %ld\n", i);
                 clusterWeightInternal[i] = 0; //Initialize to zero
@@ -1987,67 +4277,42 @@ double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* colo
             long coloradj1 = colorPtr[ci];
             long coloradj2 = colorPtr[ci+1];
 
-            //#pragma omp parallel for
+            //Vertices of one color are independent: no two of them are neighbors
+            #pragma omp parallel for schedule(dynamic, 1024)
             for (long K = coloradj1; K<coloradj2; K++) {
-                long i = colorIndex[K];
-                long localTarget = -1;
+                vertexId i = colorIndex[K];
+                vertexId localTarget = -1;
                 long adj1 = vtxPtr[i];
                 long adj2 = vtxPtr[i+1];
-                long selfLoop = 0;
-                //Build a datastructure to hold the cluster structure of its neighbors:
-                // map each neighbor's cluster to a local number
-                //long size = adj2 - adj1;
-                long size = NV;
-                //printf("size is %ld\n", size);
-                //map<long, long> clusterLocalMap; //Map each neighbor's cluster to a local number
-                dataItem** clusterLocalMap;
-                //vector<double> Counter;
-                //Number of edges to each unique cluster
-                double* Counter;
-                if (size != 0) {
-                    clusterLocalMap = (dataItem**)malloc(size * sizeof(dataItem*));
-                    for (long i = 0; i < size; i++) {
-                        clusterLocalMap[i] = NULL;
-                        //printf("true\n");
-                    }
-                    Counter = (double*)malloc(size * sizeof(double));
-                }
-                //map<long, long>::iterator storedAlready;
-                dataItem* temp = (dataItem*)malloc(sizeof(dataItem));
+                double selfLoop = 0;
+                //Map each neighbor's cluster to a local counter (edges incident, eicj)
+                clusterMap* map = &threadMaps[omp_get_thread_num()];
 
                 if(adj1 != adj2) {
-                    //Add v's current cluster:
-                    //printf("Inside here\n");
-                    //printf("currCommAss[i] : %ld\n", currCommAss[i]);
-                    insert(currCommAss[i], (long)0, size, clusterLocalMap);
-                    //temp = search(currCommAss[i], size, clusterLocalMap);
-                    //printf("temp->data : %ld\n", temp->data);
-                    Counter[0] = 0; //Initialize the counter to ZERO (no edges incident yet)
+                    resetClusterMap(map, adj2 - adj1);
+                    //Add v's current cluster with no edges incident yet:
+                    clusterMapAdd(map, currCommAss[i], 0);
                     //Find unique cluster ids and #of edges incident (eicj) to them
-                    selfLoop = buildLocalMapCounter(adj1, adj2, clusterLocalMap, Counter, vtxInd, currCommAss, i, NV);
+                    selfLoop = buildLocalMapCounter(adj1, adj2, map, vtxInd, vtxWt, currCommAss, i);
                     //Calculate the max
-                    localTarget = max(clusterLocalMap, Counter, selfLoop, cInfo, vDegree[i], currCommAss[i], constantForSecondTerm, size);
+                    localTarget = max(map, selfLoop, cInfo, vDegree[i], currCommAss[i], constantForSecondTerm,
+                        resolution);
                 } else {
                     localTarget = -1;
                 }
                 //Update prepare
                 if(localTarget != currCommAss[i] && localTarget != -1) {
-                    //__sync_fetch_and_add(&cUpdate[localTarget].degree, vDegree[i]);
+                    #pragma omp atomic
                     cUpdate[localTarget].degree += vDegree[i];
-                    //__sync_fetch_and_add(&cUpdate[localTarget].size, 1);
-                    cUpdate[localTarget].size += 1;
-                    //__sync_fetch_and_sub(&cUpdate[currCommAss[i]].degree, vDegree[i]);
-                    cUpdate[currCommAss[i]].degree = cUpdate[currCommAss[i]].degree - vDegree[i];
-                    //__sync_fetch_and_sub(&cUpdate[currCommAss[i]].size, 1);
-                    cUpdate[currCommAss[i]].size = cUpdate[currCommAss[i]].size - 1;
+                    __sync_fetch_and_add(&cUpdate[localTarget].size, 1);
+                    #pragma omp atomic
+                    cUpdate[currCommAss[i]].degree -= vDegree[i];
+                    __sync_fetch_and_sub(&cUpdate[currCommAss[i]].size, 1);
                 } // End of if
                 currCommAss[i] = localTarget;
-                freeHashArr(clusterLocalMap, size);
-                free(Counter);
             } // End of for(i)
             // UPDATE
-            // #pragma omp parallel for
-            //printf("I am here\n");
+            #pragma omp parallel for
             for (long i=0; i<NV; i++) {
                 cInfo[i].size += cUpdate[i].size;
                 cInfo[i].degree += cUpdate[i].degree;
@@ -2061,21 +4326,21 @@ double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* colo
         float modSum = 0;
 
         // CALCULATE MOD
-        // #pragma omp parallel for  //Parallelize on each vertex
-        for (long i =0; i<NV;i++){
-            clusterWeightInternal[i] = 0;
-        }
-        // #pragma omp parallel for  //Parallelize on each vertex
+        #pragma omp parallel for schedule(dynamic, 1024) //Parallelize on each vertex
         for (long i=0; i<NV; i++) {
             long adj1 = vtxPtr[i];
             long adj2 = vtxPtr[i+1];
+            float eii = 0;
             for(long j=adj1; j<adj2; j++) {
-                if(currCommAss[vtxInd[j].tail] == currCommAss[i]){
-                    clusterWeightInternal[i] += ((float)vtxInd[j].weight * (float)constantForSecondTerm);
+                if(currCommAss[vtxInd[j]] == currCommAss[i]){
+                    float w = (vtxWt == NULL) ? 1 : (float)vtxWt[j];
+                    eii += (w * (float)constantForSecondTerm);
                 }
             }
+            clusterWeightInternal[i] = eii;
         }
 
+        #pragma omp parallel for
         for (long i=0; i<NV; i++) {
             cInfoDouble[i] = (float)cInfo[i].degree * (float)constantForSecondTerm;
         }
@@ -2084,7 +4349,7 @@ double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* colo
         for (long i=0; i<NV; i++) {
             //e_xx += clusterWeightInternal[i];
             //a2_x += (cInfo[i].degree)*(cInfo[i].degree);
-            modSum += clusterWeightInternal[i] - cInfoDouble[i] * cInfoDouble[i];
+            modSum += clusterWeightInternal[i] - (float)resolution * cInfoDouble[i] * cInfoDouble[i];
         }
         time4 = omp_get_wtime();
         //currMod = e_xx*(double)constantForSecondTerm  - a2_x*(double)constantForSecondTerm*(double)constantForSecondTerm;
@@ -2112,7 +4377,9 @@ double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* colo
 #endif
 
     //Cleanup:
-    free(vDegree);
+    if (sharedDegree == NULL) {
+        free(vDegree);
+    }
     free(cInfo);
     free(cUpdate);
     free(clusterWeightInternal);
@@ -2121,309 +4388,448 @@ double algoLouvainWithDistOneColoring(graph* G, long *C, int nThreads, int* colo
     free(colorAdded);
     free(pastCommAss);
     free(cInfoDouble);
+    for (int t = 0; t < nMaps; t++) {
+        freeClusterMap(&threadMaps[t]);
+    }
+    free(threadMaps);
 
     return prevMod;
 } //End of algoLouvainWithDistOneColoring()
 
+// function : refineClusters
+// Leiden-style refinement of the clusters C of G: every vertex starts as its
+// own subcommunity and, in one parallel sweep, a vertex that is still alone
+// and well connected to its cluster joins the neighboring subcommunity of the
+// same cluster with the best positive modularity gain. Only singletons move
+// and a move needs an edge to the target, so every subcommunity is connected
+// and lies inside one cluster. Leaving and joining are compare-and-swaps on
+// the subcommunity sizes, so a subcommunity that gained a member never
+// dissolves. R receives the subcommunities numbered contiguously (-1 where C
+// is -1); returns their number. The resolution scales the null model as in
+// max(); sharedDegree, if not NULL, holds the weighted degrees of G.
+long refineClusters(graph* G, const vertexId* C, long numClusters, vertexId* R,
+        double resolution, const double* sharedDegree) {
+    long NV = G->numVertices;
+    long *vtxPtr = G->edgeListPtrs;
+    vertexId *vtxInd = G->edgeList;
+    edgeWeight *vtxWt = G->edgeWeights;
+    double time1 = omp_get_wtime();
+
+    comm* rInfo = (comm*)malloc(NV * sizeof(comm)); // Subcommunities, start as singletons
+    assert(rInfo != 0);
+    double* vDegree = (double*)sharedDegree;
+    if (sharedDegree == NULL) {
+        vDegree = (double*)malloc(NV * sizeof(double));
+        assert(vDegree != 0);
+        sumVertexDegree(vtxWt, vtxPtr, vDegree, NV, rInfo);
+    } else {
+        initSingletonClusters(vDegree, NV, rInfo);
+    }
+    double constant = calConstantForSecondTerm(vDegree, NV);
+    double* clusterDegree = (double*)malloc(numClusters * sizeof(double));
+    assert(clusterDegree != 0);
+    #pragma omp parallel for
+    for (long c=0; c<numClusters; c++) {
+        clusterDegree[c] = 0;
+    }
+    #pragma omp parallel for
+    for (long i=0; i<NV; i++) {
+        R[i] = i;
+        if (C[i] >= 0) {
+            #pragma omp atomic
+            clusterDegree[C[i]] += vDegree[i];
+        }
+    }
+    int nMaps = omp_get_max_threads();
+    clusterMap* threadMaps = (clusterMap*)malloc(nMaps * sizeof(clusterMap));
+    assert(threadMaps != 0);
+    for (int t = 0; t < nMaps; t++) {
+        initClusterMap(&threadMaps[t]);
+    }
 
-// WARNING: Will assume that the cluster id have been renumbered contiguously
-// Return the total time for building the next level of graph
-double buildNextLevelGraphOpt(graph *Gin, graph *Gout, long *C, long numUniqueClusters, int nThreads) {
-#ifdef DETAILED
-    printf("Within buildNextLevelGraphOpt(): # of unique clusters= %ld\n",numUniqueClusters);
-#endif
-    /*
-       if (nThreads < 1) {
-       omp_set_num_threads(1);
-       } else {
-       omp_set_num_threads(nThreads);
-       }
-       */
-    //int nT;
-    //#pragma omp parallel
-    //{
-    //  nT = omp_get_num_threads();
-    //}
-
-    //printf("Actual number of threads: %d (requested: %d)\n", nT, nThreads);
-    double time1, time2;
-    double TotTime=0; //For timing purposes
-    double total = 0, totItr = 0;
-    //Pointers into the input graph structure:
+    long numMoved = 0;
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+:numMoved)
+    for (long v=0; v<NV; v++) {
+        if ((C[v] < 0) || (rInfo[v].size != 1) || (vtxPtr[v] == vtxPtr[v+1])) {
+            continue;
+        }
+        //Weights to the subcommunities of the neighbors in the same cluster
+        clusterMap* map = &threadMaps[omp_get_thread_num()];
+        resetClusterMap(map, vtxPtr[v+1] - vtxPtr[v]);
+        double inside = 0;
+        for (long j=vtxPtr[v]; j<vtxPtr[v+1]; j++) {
+            vertexId u = vtxInd[j];
+            if ((u == v) || (C[u] != C[v])) {
+                continue;
+            }
+            double w = (vtxWt == NULL) ? 1 : vtxWt[j];
+            inside += w;
+            clusterMapAdd(map, R[u], w);
+        }
+        //Well connected: at least the edge weight expected at random
+        double degree = vDegree[v];
+        if ((inside == 0) || (inside < resolution*degree*(clusterDegree[C[v]] - degree)*constant)) {
+            continue;
+        }
+        vertexId best = -1;
+        double bestGain = 0;
+        for (long k = 0; k < map->numUnique; k++) {
+            vertexId r = map->keys[k];
+            double gain = map->Counter[k] - resolution*degree*rInfo[r].degree*constant;
+            if ((r != v) && ((gain > bestGain) || ((gain == bestGain) && (best >= 0) && (r < best)))) {
+                bestGain = gain;
+                best = r;
+            }
+        }
+        if (best < 0) {
+            continue;
+        }
+        //Leave the singleton unless someone joined it meanwhile
+        if (!__sync_bool_compare_and_swap(&rInfo[v].size, 1, 0)) {
+            continue;
+        }
+        //Join best unless it dissolved meanwhile
+        bool joined = false;
+        while (true) {
+            vertexId size = rInfo[best].size;
+            if (size == 0) {
+                break;
+            }
+            if (__sync_bool_compare_and_swap(&rInfo[best].size, size, size+1)) {
+                joined = true;
+                break;
+            }
+        }
+        if (!joined) {
+            __sync_fetch_and_add(&rInfo[v].size, 1); //Nobody can have joined an empty subcommunity
+            continue;
+        }
+        #pragma omp atomic
+        rInfo[best].degree += degree;
+        R[v] = best;
+        numMoved++;
+    }
+
+    #pragma omp parallel for
+    for (long i=0; i<NV; i++) {
+        if (C[i] < 0) {
+            R[i] = -1; //Dropped from the next level, as without refinement
+        }
+    }
+    long numRefined = renumberClustersContiguously(R, NV);
+    printf("Refinement: %ld clusters split into %ld subcommunities (%ld vertices merged) in %3.3lf\n",
+            numClusters, numRefined, numMoved, omp_get_wtime() - time1);
+
+    if (sharedDegree == NULL) {
+        free(vDegree);
+    }
+    free(rInfo);
+    free(clusterDegree);
+    for (int t = 0; t < nMaps; t++) {
+        freeClusterMap(&threadMaps[t]);
+    }
+    free(threadMaps);
+    return numRefined;
+} //End of refineClusters()
+
+
+// function : aggregateClusters
+// WARNING : will assume that cluster ids have been renumbered contiguously
+// Build Gout by collapsing every cluster of Gin into a single vertex.
+// Vertices with C[i] < 0 are dropped. The weights of all edges between two
+// clusters are summed into one edge, and the edges inside a cluster into its
+// self-loop. With allSelfLoops every cluster gets a self-loop, with zero
+// weight if it has no internal edges.
+// Gin may be unweighted (no weight array); Gout always carries weights.
+// Vertices are first bucketed by cluster, then each cluster accumulates the
+// weights to its neighbor clusters in a per-thread clusterMap: once to count
+// the row lengths of Gout, and once more to write the rows after a prefix sum.
+// Return : number of self-loops in Gout
+long aggregateClusters(graph *Gin, graph *Gout, vertexId *C, long numUniqueClusters, bool allSelfLoops) {
     long    NV_in        = Gin->numVertices;
-    long    NE_in        = Gin->numEdges;
     long    *vtxPtrIn    = Gin->edgeListPtrs;
-    edge    *vtxIndIn    = Gin->edgeList;
+    vertexId *vtxIndIn   = Gin->edgeList;
+    edgeWeight *vtxWtIn  = Gin->edgeWeights;
+    long    NV_out       = numUniqueClusters;
+
+    /* Step 1 : Regroup the nodes by cluster (counting sort) */
+    long *cluPtr = (long *) malloc ((NV_out+1) * sizeof(long));
+    assert(cluPtr != 0);
+    long *cluAdded = (long *) malloc (NV_out * sizeof(long));
+    assert(cluAdded != 0);
+    long *cluSize = (long *) malloc (NV_out * sizeof(long)); //Sum of member degrees
+    assert(cluSize != 0);
+    #pragma omp parallel for
+    for (long c = 0; c <= NV_out; c++) {
+        cluPtr[c] = 0;
+        if (c < NV_out) {
+            cluAdded[c] = 0;
+            cluSize[c] = 0;
+        }
+    }
+    #pragma omp parallel for
+    for (long i = 0; i < NV_in; i++) {
+        if (C[i] >= 0) {
+            assert(C[i] < NV_out);
+            __sync_fetch_and_add(&cluPtr[C[i]+1], 1);
+            __sync_fetch_and_add(&cluSize[C[i]], vtxPtrIn[i+1] - vtxPtrIn[i]);
+        }
+    }
+    parallelPrefixSum(cluPtr+1, NV_out);
+    vertexId *cluVtx = (vertexId *) malloc ((cluPtr[NV_out]+1) * sizeof(vertexId));
+    assert(cluVtx != 0);
+    #pragma omp parallel for
+    for (long i = 0; i < NV_in; i++) {
+        if (C[i] >= 0) {
+            long Where = cluPtr[C[i]] + __sync_fetch_and_add(&cluAdded[C[i]], 1);
+            cluVtx[Where] = i;
+        }
+    }
 
-    time1 = omp_get_wtime();
-    // Pointers into the output graph structure
-    long NV_out = numUniqueClusters;
-    long NE_out = 0;
-    long *vtxPtrOut = (long *) malloc ((NV_out+1)*sizeof(long)); 
+    //One reusable neighbor-cluster map per thread
+    int nMaps = omp_get_max_threads();
+    clusterMap* threadMaps = (clusterMap*)malloc(nMaps * sizeof(clusterMap));
+    assert(threadMaps != 0);
+    for (int t = 0; t < nMaps; t++) {
+        initClusterMap(&threadMaps[t]);
+    }
+
+    /* Step 2 : Count the distinct neighbor clusters of every cluster */
+    long *vtxPtrOut = (long *) malloc ((NV_out+1)*sizeof(long));
     assert(vtxPtrOut != 0);
     vtxPtrOut[0] = 0; //First location is always a zero
-    /* Step 1 : Regroup the node into cluster node */
-#ifdef DETAILED
-    printf("numUniqueClusters : %ld\n", numUniqueClusters);
-    printf("NV_in : %ld\n", NV_in);
-#endif
-    dataItem*** cluPtrIn = (dataItem***)malloc(numUniqueClusters * sizeof(dataItem**));
-    assert(cluPtrIn != 0);
-    long* sizeArr = (long*)malloc(numUniqueClusters * sizeof(long));
-    assert(sizeArr != 0);
-
-    //#pragma omp parallel for
-    // keep track of zero weight
-    /*
-       for (long i=0; i<numUniqueClusters; i++) {
-       cluPtrIn[i] = new map<long,long>();
-       (*(cluPtrIn[i]))[i] = 0; //Add for a self loop with zero weight
-       }
-       */
-    for (long i=0; i<numUniqueClusters; i++) {
-        cluPtrIn[i] = (dataItem**)malloc(numUniqueClusters * (sizeof(dataItem*)));
-        for (long k = 0; k < numUniqueClusters; k++) {
-            cluPtrIn[i][k] = NULL;
+    long NE_self = 0;
+    #pragma omp parallel for schedule(dynamic, 16) reduction(+:NE_self)
+    for (long c = 0; c < NV_out; c++) {
+        clusterMap* map = &threadMaps[omp_get_thread_num()];
+        resetClusterMap(map, (cluSize[c] < NV_out) ? cluSize[c] : NV_out);
+        if (allSelfLoops) {
+            clusterMapAdd(map, c, 0); //Self loop with zero weight
+        }
+        for (long k = cluPtr[c]; k < cluPtr[c+1]; k++) {
+            vertexId i = cluVtx[k];
+            for (long j = vtxPtrIn[i]; j < vtxPtrIn[i+1]; j++) {
+                clusterMapAdd(map, C[vtxIndIn[j]], (vtxWtIn == NULL) ? 1 : vtxWtIn[j]);
+            }
+        }
+        vtxPtrOut[c+1] = map->numUnique;
+        if (allSelfLoops) {
+            NE_self++;
+        } else {
+            for (long u = 0; u < map->numUnique; u++) {
+                if (map->keys[u] == c) {
+                    NE_self++;
+                    break;
+                }
+            }
+        }
+    }
+    parallelPrefixSum(vtxPtrOut+1, NV_out);
+
+    /* Step 3 : Build the edge list, one row per cluster */
+    long numEdges = vtxPtrOut[NV_out];
+    vertexId *vtxIndOut = (vertexId *) malloc (numEdges * sizeof(vertexId));
+    assert(vtxIndOut != 0);
+    edgeWeight *vtxWtOut = (edgeWeight *) malloc (numEdges * sizeof(edgeWeight));
+    assert(vtxWtOut != 0);
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (long c = 0; c < NV_out; c++) {
+        clusterMap* map = &threadMaps[omp_get_thread_num()];
+        resetClusterMap(map, (cluSize[c] < NV_out) ? cluSize[c] : NV_out);
+        if (allSelfLoops) {
+            clusterMapAdd(map, c, 0);
+        }
+        for (long k = cluPtr[c]; k < cluPtr[c+1]; k++) {
+            vertexId i = cluVtx[k];
+            for (long j = vtxPtrIn[i]; j < vtxPtrIn[i+1]; j++) {
+                clusterMapAdd(map, C[vtxIndIn[j]], (vtxWtIn == NULL) ? 1 : vtxWtIn[j]);
+            }
+        }
+        long Where = vtxPtrOut[c];
+        for (long u = 0; u < map->numUnique; u++, Where++) {
+            vtxIndOut[Where] = map->keys[u];
+            vtxWtOut[Where] = map->Counter[u];
         }
-        insert(i, (long)0, numUniqueClusters, cluPtrIn[i]); // Add for a self loop with zero weight 
-        //displayHashMap(cluPtrIn[i], numUniqueClusters);
-        //printf("key : %ld\n", cluPtrIn[i][i]->key);
-        //printf("value : %ld\n", cluPtrIn[i][i]->data);
     }
-    //printf("I am here\n");
-
 
-    //#pragma omp parallel for
-    for (long i = 1; i <= NV_out; i++) {
-        vtxPtrOut[i] = 1; // Count self-loops for every vertex
+    // Set the pointers
+    // Note: Self-loops are represented ONCE, but others appear TWICE
+    Gout->numVertices  = NV_out;
+    Gout->sVertices    = NV_out;
+    Gout->numEdges     = NE_self + (numEdges - NE_self)/2;
+    Gout->edgeListPtrs = vtxPtrOut;
+    Gout->edgeList     = vtxIndOut;
+    Gout->edgeWeights  = vtxWtOut;
+    Gout->vertexWeights = NULL;
+    Gout->mapBase      = NULL;
+    Gout->mapSize      = 0;
+
+    //Clean up
+    for (int t = 0; t < nMaps; t++) {
+        freeClusterMap(&threadMaps[t]);
     }
+    free(threadMaps);
+    free(cluPtr);
+    free(cluAdded);
+    free(cluSize);
+    free(cluVtx);
 
-    //Create an array of locks for each cluster
-    /*
-       omp_lock_t *nlocks = (omp_lock_t *) malloc (numUniqueClusters * sizeof(omp_lock_t));
-       assert(nlocks != 0);
-#pragma omp parallel for
-for (long i=0; i<numUniqueClusters; i++) {
-omp_init_lock(&nlocks[i]); //Initialize locks
-}
-*/
-time2 = omp_get_wtime();
-TotTime += (time2-time1);
+    return NE_self;
+} // End of aggregateClusters
 
+// WARNING: Will assume that the cluster id have been renumbered contiguously
+// Return the total time for building the next level of graph
+// Every cluster becomes a vertex with a self-loop (zero weight if it has no internal edges)
+double buildNextLevelGraphOpt(graph *Gin, graph *Gout, vertexId *C, long numUniqueClusters, int nThreads) {
 #ifdef DETAILED
-printf("Time to initialize: %3.3lf\n", (time2-time1));
+    printf("Within buildNextLevelGraphOpt(): # of unique clusters= %ld\n",numUniqueClusters);
 #endif
-
-time1 = omp_get_wtime();
-
-/*
-//#pragma omp parallel for
-for (long i=0; i<NV_in; i++) {
-printf("i : %ld\n", i);
-long adj1 = vtxPtrIn[i];
-long adj2 = vtxPtrIn[i+1];
-assert(C[i] < numUniqueClusters);
-//Now look for all the neighbors of this cluster
-for(long j=adj1; j<adj2; j++) {
-long tail = vtxIndIn[j].tail;
-assert(C[tail] < numUniqueClusters);
-//Add the edge from one endpoint
-if(C[i] > C[tail]) {
-sizeArr[C[i]]++;
-} 
-if (C[i] == C[tail] && i <= tail) {
-sizeArr[C[i]]++;
-}
-}
-printf("here\n");
-cluPtrIn[C[i]] = (dataItem**)malloc(sizeArr[C[i]] * (sizeof(dataItem)));
-for (long k = 0; k < sizeArr[C[i]]; k++) {
-cluPtrIn[C[i]][k] = NULL;
-printf("true\n");
-}
-}
-*/
-/*
-   for (long i = 0; i < numUniqueClusters; i++) {
-   displayHashMap(cluPtrIn[C[i]], numUniqueClusters);
-   }
-   */
-
-for (long i = 0; i < NV_in; i++) {
-    long adj1 = vtxPtrIn[i];
-    long adj2 = vtxPtrIn[i+1];
-    dataItem* temp = (dataItem*)malloc(sizeof(dataItem));
-    assert(temp != 0);
-    assert(C[i] < numUniqueClusters);
-    // Now look for all the neighbors of this cluster
-    for (long j = adj1; j < adj2; j++) {
-        long tail = vtxIndIn[j].tail;
-        assert(C[tail] < numUniqueClusters);
-        //Add the edge from one endpoint
-        if(C[i] >= C[tail]) {
-            // Care about this later
-            /*
-               omp_set_lock(&nlocks[C[i]]);  // Locking the cluster
-               */
-            temp = search(C[tail], numUniqueClusters, cluPtrIn[C[i]]);
-            //displayHashMap(cluPtrIn[3], numUniqueClusters);
-
-            if (temp != NULL) {
-                //printf("C[tail] is %ld and i is %ld and C[i] is %ld\n", C[tail], i, C[i]);
-                //displayHashMap(cluPtrIn[C[i]], numUniqueClusters);
-                //printf("adding %ld\n", (long)vtxIndIn[j].weight);
-                temp->data += (long)vtxIndIn[j].weight;
-                //printf("new temp->data %ld\n", temp->data);
-                //displayHashMap(cluPtrIn[C[i]], numUniqueClusters);
-            } else {
-                //printf("I am inserting : %ld\n", (long)vtxIndIn[j].weight);
-                //printf("C[i] is %ld\n", C[i]);
-                //displayHashMap(cluPtrIn[C[i]], numUniqueClusters);
-                insert(C[tail], (long)vtxIndIn[j].weight, numUniqueClusters, cluPtrIn[C[i]]); // Inter-community edge
-                //printf("C[i] is %ld\n", C[i]);
-                //displayHashMap(cluPtrIn[C[i]], numUniqueClusters);
-                //__sync_fetch_and_add(&vtxPtrOut[C[i]+1], 1);
-                vtxPtrOut[C[i]+1] = vtxPtrOut[C[i]+1] + 1;
-                if(C[i] > C[tail]) {
-                    //Keep track of non-self #edges
-                    //__sync_fetch_and_add(&NE_out, 1);
-                    NE_out++;
-                    //Count edge j-->i
-                    //__sync_fetch_and_add(&vtxPtrOut[C[tail]+1], 1);
-                    vtxPtrOut[C[tail]+1] = vtxPtrOut[C[tail]+1] + 1;
-                }
-            }
-            //printf("illa2\n");
-            //displayHashMap(cluPtrIn[3], numUniqueClusters);
-            /* Dont understand the point of this now
-               omp_unset_lock(&nlocks[C[i]]); // Unlocking the cluster
-               */
-        } // End of if
-    } // End of for(j)
-    //free(temp);
-}// End of for(i)
-//Prefix sum:
-for(long i=0; i<NV_out; i++) {
-    vtxPtrOut[i+1] += vtxPtrOut[i];
-}
-
-time2 = omp_get_wtime();
-TotTime += (time2 - time1);
+    double time1 = omp_get_wtime();
+    aggregateClusters(Gin, Gout, C, numUniqueClusters, true);
+    double TotTime = omp_get_wtime() - time1;
 #ifdef DETAILED
-printf("NE_out : %ld\n", NE_out);
-printf("NV_out : %ld\n", NV_out);
-printf("These should match: %ld == %ld\n",(2*NE_out + NV_out), vtxPtrOut[NV_out]);
-printf("Time to count edges: %3.3lf\n", (time2 - time1));
+    printf("NV_out : %ld\n", Gout->numVertices);
+    printf("NE_out : %ld\n", Gout->numEdges - Gout->numVertices);
+    printf("Total time to build next phase: %3.3lf\n", TotTime);
 #endif
-assert(vtxPtrOut[NV_out] == (NE_out*2+NV_out)); //Sanity check
-
-time1 = omp_get_wtime();
-// Step 3 : build the edge list:
-long numEdges   = vtxPtrOut[NV_out];
-long realEdges  = numEdges - NE_out; //Self-loops appear once, others appear twice
-edge *vtxIndOut = (edge *)malloc(numEdges * sizeof(edge));
-assert (vtxIndOut != 0);
-long *Added = (long *) malloc (NV_out * sizeof(long)); //Keep track of what got added
-assert (Added != 0);
-
-//#pragma omp parallel for
-for (long i=0; i<NV_out; i++) {
-    Added[i] = 0;
-}
+    return TotTime;
+} // End of buildNextLevelGraphOpt
 
-/*
-   for (long i = 0; i < NV_out; i++) {
-   displayHashMap(cluPtrIn[i], NV_out);
-   for (long s = 0; s < NV_out; s++) {
-   if (!cluPtrIn[i][s]) {
-   printf("NULL i : %ld s : %ld\n", i, s);
-   } else {
-   printf("Non NULL i : %ld s : %ld\n", i, s);
-   printf("key : %ld\n", cluPtrIn[i][s]->key);
-   printf("value : %ld\n", cluPtrIn[i][s]->data);
-   }
-   }
-   } 
-   */
-
-//Now add the edges in no particular order
-//#pragma omp parallel for
-dataItem* temp = (dataItem*)malloc(sizeof(dataItem));
-for (long i = 0; i < NV_out; i++) {
-    //printf("step 3 : i : %ld\n", i);
-    long j = 0;
-    long Where;
-    temp = cluPtrIn[i][j];
-    // Now go through the other edges
-    while (j < numUniqueClusters) {
-        // Don't understand the point of this right now
-        // Where = vtxPtrOut[i] + __sync_fetch_and_add(&Added[i], 1);
-        //printf("I am here\n");
-        //printf("j : %ld\n", j);
-        if (temp != NULL) {
-            Where = vtxPtrOut[i] + Added[i]++;
-            //printf("Where : %ld\n", Where);
-            vtxIndOut[Where].head = i; // Head
-            //printf("i : %ld\n", i);
-            vtxIndOut[Where].tail = temp->key; // Tail
-            //printf("temp->key : %ld\n", temp->key);
-            vtxIndOut[Where].weight = temp->data; // Weight
-            //printf("temp->data : %ld\n", temp->data);
-            if (i != temp->key) {
-                // Don't understand the point of this now
-                // Where = vtxPtrOut[temp->key] + __sync_fetch_and_add(&Added[i], 1);
-                //
-                //printf("i != temp->key\n");
-                Where = vtxPtrOut[temp->key] + Added[temp->key]++;
-                //printf("I am here\n");
-                vtxIndOut[Where].head = temp->key;
-                vtxIndOut[Where].tail = i; // Tail
-                vtxIndOut[Where].weight = temp->data; // Weight
-            }
-        }
-        j++;
-        temp = cluPtrIn[i][j];
-    } // End of while
-} // End of for(i)
-//free(temp);
-
-time2 = omp_get_wtime();
-TotTime += (time2-time1);
+// function : buildNewGraphVF
+// WARNING : will assume that cluster id have been renumbered contiguously
+// Return the total time for building the next level of graph
+// This will not add any self-loops
+double buildNewGraphVF(graph* Gin, graph* Gout, vertexId* C, long numUniqueClusters) {
 #ifdef DETAILED
-printf("Time to build graph: %3.3lf\n", (double)(time2 - time1)/CLOCKS_PER_SEC);
-printf("Total time: %3.3lf\n", TotTime);
-printf("Total time to build next phase: %3.3lf\n", TotTime);
+    printf("Inside buildNewGraphVF: # of unique clusters= %ld\n",numUniqueClusters);
 #endif
+    double start = omp_get_wtime();
+    long NE_self = aggregateClusters(Gin, Gout, C, numUniqueClusters, false);
+    double totTime = omp_get_wtime() - start;
+    printf("NE_out=%ld  NE_self=%ld\n", Gout->numEdges - NE_self, NE_self);
+#ifdef DETAILED
+    printf("Total time: %3.3lf\n", totTime);
+#endif
+    return(totTime);
+} // End of buildNewGraphVF
 
-// Set the pointers
-Gout->numVertices  = NV_out;
-Gout->sVertices    = NV_out;
-//Note: Self-loops are represented ONCE, but others appear TWICE
-Gout->numEdges     = realEdges; //Add self loops to the #edges
-Gout->edgeListPtrs = vtxPtrOut;
-Gout->edgeList     = vtxIndOut;
-
-//Clean up
-free(Added);
-
-// Don't understand the point of it right now
-//#pragma omp parallel for
-for (long i=0; i<numUniqueClusters; i++) {
-    freeHashArr(cluPtrIn[i], numUniqueClusters);    
-}
-free(cluPtrIn);
-//printf("I am here\n");
-
-//#pragma omp parallel for
-/*
-   for (long i=0; i<numUniqueClusters; i++) {
-   omp_destroy_lock(&nlocks[i]);
-   }
-   free(nlocks);
-   */
-return TotTime;
-} // End of buildNextLevelGraphOpt
 
+// function : writeAll
+// write() the whole buffer, retrying after partial writes
+bool writeAll(int fd, const char* buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w <= 0) {
+            return false;
+        }
+        buf += w;
+        n -= w;
+    }
+    return true;
+} // End of writeAll
+
+// struct : dendrogram
+// A dendrogram file being written, one level per phase (see dendrogram.h)
+typedef struct dendrogram {
+    int fd;
+    int idWidth;
+    bool ok; /* false after the first write error */
+    long numLevels;
+    long *sizes; /* sizes[0..numLevels] */
+    long capacity; /* length of sizes */
+    const char *filename;
+} dendrogram;
+
+// function : dendrogramOpen
+// Start a dendrogram file for a graph with numVertices vertices; returns NULL on failure
+dendrogram* dendrogramOpen(const char* filename, long numVertices) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open file %s for writing\n", filename);
+        return NULL;
+    }
+    dendrogram* D = (dendrogram*)malloc(sizeof(dendrogram));
+    assert(D != 0);
+    D->fd = fd;
+    D->idWidth = (numVertices <= INT_MAX) ? 4 : 8; // Ids only shrink from level to level
+    D->numLevels = 0;
+    D->capacity = 64;
+    D->sizes = (long*)malloc(D->capacity*sizeof(long));
+    assert(D->sizes != 0);
+    D->sizes[0] = numVertices;
+    D->filename = filename;
+    // The header is rewritten with the final level count when the file is closed
+    dendrogramHeader header;
+    memset(&header, 0, sizeof(header));
+    D->ok = writeAll(fd, (const char*)&header, sizeof(header));
+    return D;
+} // End of dendrogramOpen
+
+// function : dendrogramAddLevel
+// Append the parent array of the current top level (sizes[numLevels] entries),
+// whose nodes were grouped into numParents clusters
+void dendrogramAddLevel(dendrogram* D, const vertexId* parent, long numParents) {
+    if ((D == NULL) || !D->ok) {
+        return;
+    }
+    long n = D->sizes[D->numLevels];
+    const char* data = (const char*)parent;
+    char* converted = NULL;
+    if (D->idWidth != sizeof(vertexId)) {
+        converted = (char*)malloc(n*D->idWidth);
+        assert(converted != 0);
+        if (D->idWidth == 4) {
+            int* out = (int*)converted;
+            #pragma omp parallel for
+            for (long i = 0; i < n; i++) {
+                out[i] = (int)parent[i];
+            }
+        } else {
+            long* out = (long*)converted;
+            #pragma omp parallel for
+            for (long i = 0; i < n; i++) {
+                out[i] = parent[i];
+            }
+        }
+        data = converted;
+    }
+    char padding[8] = {0};
+    size_t padBytes = (8 - (n*D->idWidth) % 8) % 8;
+    D->ok = writeAll(D->fd, data, n*D->idWidth) && writeAll(D->fd, padding, padBytes);
+    free(converted);
+    if (D->numLevels + 2 > D->capacity) {
+        D->capacity *= 2;
+        D->sizes = (long*)realloc(D->sizes, D->capacity*sizeof(long));
+        assert(D->sizes != 0);
+    }
+    D->numLevels++;
+    D->sizes[D->numLevels] = numParents;
+} // End of dendrogramAddLevel
+
+// function : dendrogramClose
+// Write the level sizes and the final header, then release D
+bool dendrogramClose(dendrogram* D) {
+    if (D == NULL) {
+        return false;
+    }
+    dendrogramHeader header;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, "CGDENDR");
+    header.version = DENDROGRAM_VERSION;
+    header.idWidth = D->idWidth;
+    header.numLevels = D->numLevels;
+    header.numVertices = D->sizes[0];
+    bool ok = D->ok
+        && writeAll(D->fd, (const char*)D->sizes, (D->numLevels+1)*sizeof(long))
+        && (pwrite(D->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header));
+    ok = (close(D->fd) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "Error writing dendrogram file %s\n", D->filename);
+    }
+    free(D->sizes);
+    free(D);
+    return ok;
+} // End of dendrogramClose
 
 // function : runMultiPhaseLouvainAlgorithm
 // WARNING : This will overwrite the original graph data structure to
@@ -2431,8 +4837,26 @@ return TotTime;
 // Return : C_orig will hold the cluster ids for vertices in the 
 // original graph. Assume C_orig is initialized appropriately
 // WARNING : Graph G will be destroyed at the end of this routine.
-void runMultiPhaseLouvainAlgorithm(graph* G, long* C_orig, int coloring, long minGraphSize, 
-        double threshold, double C_threshold, int numThreads) {
+// If levels != NULL, every phase's cluster map is appended to it.
+// pruneInactive enables the active-set mode of parallelLouvianMethod.
+// With refine, the clusters of every phase are refined (refineClusters) and
+// the subcommunities become the vertices of the next level, which starts
+// from the unrefined clusters; C_orig then tracks the vertices of the current
+// level and takes the final clusters once the loop ends. A refined level that
+// does not gain is aggregated once more without refinement (every cluster a
+// singleton), so whole clusters can still merge before the loop stops.
+// resolution scales the null-model term of the modularity (1 is standard).
+// If sharedDegree is not NULL, G is the input graph shared by concurrent runs
+// and sharedDegree its weighted degrees: both are read-only and G is not freed.
+// If startSeed is not NULL, the first phase starts from these clusters instead
+// of singletons and, if startActive is not NULL too, evaluates only the flagged
+// vertices at first (incremental mode; the first phase then runs without coloring).
+// With coarsenStart, the first phase takes the startSeed clusters as they are.
+// Returns the final modularity.
+double runMultiPhaseLouvainAlgorithm(graph* G, vertexId* C_orig, int coloring, long minGraphSize, 
+        double threshold, double C_threshold, int numThreads, dendrogram* levels, bool pruneInactive,
+        bool refine, double resolution, const double* sharedDegree, const vertexId* startSeed,
+        const unsigned char* startActive, bool coarsenStart) {
     double totTimeClustering=0, totTimeBuildingPhase=0, totTimeColoring=0, tmpTime;
     int tmpItr=0, totItr=0;
     long NV = G->numVertices;
@@ -2461,8 +4885,19 @@ void runMultiPhaseLouvainAlgorithm(graph* G, long* C_orig, int coloring, long mi
 
     graph *Gnew; //To build new hierarchical graphs
     long numClusters;
-    long *C = (long *) malloc (NV * sizeof(long));
+    vertexId *C = (vertexId *) malloc (NV * sizeof(vertexId));
     assert(C != 0);
+    vertexId *seed = NULL; //Starting clusters of the current level (refinement or startSeed)
+    bool refinedLevel = false; //The vertices of the current level are refined subcommunities
+    if (startSeed != NULL) {
+        seed = (vertexId *) malloc (NV * sizeof(vertexId));
+        assert(seed != 0);
+        #pragma omp parallel for
+        for (long i=0; i<NV; i++) {
+            seed[i] = startSeed[i];
+        }
+    }
+    const double *levelDegree = sharedDegree; //Set only while G is the shared input
 
     // #pragma omp parallel for
     for (long i=0; i<NV; i++) {
@@ -2475,13 +4910,24 @@ void runMultiPhaseLouvainAlgorithm(graph* G, long* C_orig, int coloring, long mi
         printf("===============================\n");
         prevMod = currMod;
         //Compute clusters
-        if((coloring == 1)&&(G->numVertices > minGraphSize)&&(nonColor == false)) {
+        if((phase == 1)&&coarsenStart&&(seed != NULL)) {
+            //Aggregate the start clusters without local moving
+            #pragma omp parallel for
+            for (long i=0; i<NV; i++) {
+                C[i] = seed[i];
+            }
+            currMod = partitionModularity(G, C, resolution);
+            printf("Coarsening the start clusters (modularity %lf)\n", currMod);
+        } else if((coloring == 1)&&(G->numVertices > minGraphSize)&&(nonColor == false)
+                &&((phase > 1)||(startActive == NULL))) {
             //Use higher modularity for the first few iterations when graph is big enough
-            currMod = algoLouvainWithDistOneColoring(G, C, numThreads, colors, numColors, currMod, C_threshold, &tmpTime, &tmpItr);
+            currMod = algoLouvainWithDistOneColoring(G, C, numThreads, colors, numColors, currMod, C_threshold, &tmpTime, &tmpItr, seed,
+                    resolution, levelDegree);
             totTimeClustering += tmpTime;
             totItr += tmpItr;
         } else {
-            currMod = parallelLouvianMethod(G, C, numThreads, currMod, threshold, &tmpTime, &tmpItr);
+            currMod = parallelLouvianMethod(G, C, numThreads, currMod, threshold, &tmpTime, &tmpItr, pruneInactive, seed,
+                    resolution, levelDegree, (phase == 1) ? startActive : NULL);
             totTimeClustering += tmpTime;
             totItr += tmpItr;
             nonColor = true;
@@ -2489,9 +4935,14 @@ void runMultiPhaseLouvainAlgorithm(graph* G, long* C_orig, int coloring, long mi
         //Renumber the clusters contiguiously
         numClusters = renumberClustersContiguously(C, G->numVertices);
         printf("Number of unique clusters: %ld\n", numClusters);
+        if (!refine) {
+            dendrogramAddLevel(levels, C, numClusters);
+        }
         //printf("About to update C_orig\n");
         //Keep track of clusters in C_orig
-        if(phase == 1) {
+        if (refine) {
+            //Deferred: the next level is built from the refined clusters
+        } else if(phase == 1) {
             //#pragma omp parallel for
             for (long i=0; i<NV; i++) {
                 C_orig[i] = C[i]; //After the first phase
@@ -2512,21 +4963,66 @@ void runMultiPhaseLouvainAlgorithm(graph* G, long* C_orig, int coloring, long mi
         }
         //Check for modularity gain and build the graph for next phase
         //In case coloring is used, make sure the non-coloring routine is run at least once
-        if( (currMod - prevMod) > threshold ) {
+        //With refinement, a refined level that gained nothing is followed by one
+        //unrefined aggregation: only singletons of whole clusters can merge them
+        bool plainStep = refine && refinedLevel && ((currMod - prevMod) <= threshold);
+        if( ((currMod - prevMod) > threshold) || plainStep ) {
             Gnew = (graph *) malloc (sizeof(graph)); 
             assert(Gnew != 0);
+            if (refine) {
+                //Aggregate the refined subcommunities; each starts in its cluster
+                vertexId *R = (vertexId *) malloc (G->numVertices * sizeof(vertexId));
+                assert(R != 0);
+                long numRefined = numClusters;
+                free(seed);
+                seed = NULL;
+                if (plainStep) {
+                    #pragma omp parallel for
+                    for (long i=0; i<G->numVertices; i++) {
+                        R[i] = C[i]; //Every cluster starts alone
+                    }
+                } else {
+                    numRefined = refineClusters(G, C, numClusters, R, resolution, levelDegree);
+                }
+                if (numRefined > numClusters) { //Some cluster was split
+                    seed = (vertexId *) malloc (numRefined * sizeof(vertexId));
+                    assert(seed != 0);
+                    #pragma omp parallel for
+                    for (long i=0; i<G->numVertices; i++) {
+                        if (R[i] >= 0) {
+                            seed[R[i]] = C[i]; //All members share the cluster
+                        }
+                    }
+                }
+                refinedLevel = (numRefined > numClusters);
+                #pragma omp parallel for
+                for (long i=0; i<NV; i++) {
+                    if (phase == 1) {
+                        C_orig[i] = R[i];
+                    } else if (C_orig[i] >= 0) {
+                        C_orig[i] = R[C_orig[i]];
+                    }
+                }
+                dendrogramAddLevel(levels, R, numRefined);
+                free(C);
+                C = R;
+                numClusters = numRefined;
+            }
             tmpTime = buildNextLevelGraphOpt(G, Gnew, C, numClusters, numThreads);
             totTimeBuildingPhase += tmpTime;
-            //Free up the previous graph
-            free(G->edgeListPtrs);
-            free(G->edgeList);
-            free(G);
+            //Free up the previous graph (unless it is the shared input)
+            if (levelDegree == NULL) {
+                freeGraph(G);
+            }
+            levelDegree = NULL;
+            if (!refine) {
+                free(seed); //startSeed only applies to the first phase
+                seed = NULL;
+            }
             G = Gnew; //Swap the pointers
-            G->edgeListPtrs = Gnew->edgeListPtrs;
-            G->edgeList = Gnew->edgeList;
             //Free up the previous cluster & create new one of a different size
             free(C);
-            C = (long *) malloc (numClusters * sizeof(long)); 
+            C = (vertexId *) malloc (numClusters * sizeof(vertexId)); 
             assert(C != 0);
             //#pragma omp parallel for
             for (long i=0; i<numClusters; i++) {
@@ -2534,7 +5030,7 @@ void runMultiPhaseLouvainAlgorithm(graph* G, long* C_orig, int coloring, long mi
             }
             phase++; //Increment phase number
             //If coloring is enabled & graph is of minimum size, recolor the new graph
-            if((coloring == 1)&&(G->numVertices > minGraphSize)&&(nonColor = false)){
+            if((coloring == 1)&&(G->numVertices > minGraphSize)&&(nonColor == false)){
                 //#pragma omp parallel for
                 for (long i=0; i<G->numVertices; i++){
                     colors[i] = -1;
@@ -2551,6 +5047,18 @@ void runMultiPhaseLouvainAlgorithm(graph* G, long* C_orig, int coloring, long mi
         }
     } //End of while(1)
 
+    if (refine) { //The last phase was not aggregated: apply its clusters
+        #pragma omp parallel for
+        for (long i=0; i<NV; i++) {
+            if (phase == 1) {
+                C_orig[i] = C[i];
+            } else if (C_orig[i] >= 0) {
+                C_orig[i] = C[C_orig[i]];
+            }
+        }
+        dendrogramAddLevel(levels, C, numClusters);
+    }
+
     printf("********************************************\n");
     printf("*********    Compact Summary   *************\n");
     printf("********************************************\n");
@@ -2570,17 +5078,257 @@ void runMultiPhaseLouvainAlgorithm(graph* G, long* C_orig, int coloring, long mi
 
     //Clean up:
     free(C);
-    if(G != 0) {
-        free(G->edgeListPtrs);
-        free(G->edgeList);
-        free(G);
+    free(seed);
+    if((G != 0) && (levelDegree == NULL)) {
+        freeGraph(G);
     }
 
     if(coloring==1) {
         if(colors != 0) free(colors);
     }
+    return prevMod;
 } //End of runMultiPhaseLouvainAlgorithm()
 
+// function : formatLong
+// Render v in decimal at p, two digits at a time; returns the number of characters
+int formatLong(char* p, long v) {
+    static const char pairs[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[20];
+    int n = 0, len = 0;
+    unsigned long u = (unsigned long)v;
+    if (v < 0) {
+        p[len++] = '-';
+        u = 0UL - u;
+    }
+    while (u >= 100) {
+        unsigned long q = u / 100;
+        int r = (int)(u - q*100);
+        tmp[n++] = pairs[2*r + 1];
+        tmp[n++] = pairs[2*r];
+        u = q;
+    }
+    if (u >= 10) {
+        tmp[n++] = pairs[2*u + 1];
+        tmp[n++] = pairs[2*u];
+    } else {
+        tmp[n++] = (char)('0' + u);
+    }
+    while (n > 0) {
+        p[len++] = tmp[--n];
+    }
+    return len;
+} // End of formatLong
+
+// function : outputCluster
+// Final cluster of input vertex i, looking through the vertex-following map
+static inline long outputCluster(const vertexId* C, const vertexId* vfMap, long i) {
+    if (vfMap == NULL) {
+        return C[i];
+    }
+    return (vfMap[i] >= 0) ? C[vfMap[i]] : -1;
+}
+
+#define OUTPUT_BLOCK (1L << 20) // Vertices rendered by one thread per round
+#define OUTPUT_LINE 48 // Longest line: two longs, a space and a newline
+
+// function : writeClusterText
+// One line per input vertex, prefixed by its original id when origIds != NULL.
+// Every round the threads render nT blocks of vertices into their own buffers,
+// then the blocks are written in order with one large write each.
+bool writeClusterText(const char* filename, const vertexId* C, const vertexId* vfMap,
+                      const long* origIds, long NV_in) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open file %s for writing\n", filename);
+        return false;
+    }
+    int nT = omp_get_max_threads();
+    char** buf = (char**)malloc(nT*sizeof(char*));
+    assert(buf != 0);
+    size_t* len = (size_t*)malloc(nT*sizeof(size_t));
+    assert(len != 0);
+    for (int t = 0; t < nT; t++) {
+        buf[t] = (char*)malloc(OUTPUT_BLOCK*OUTPUT_LINE);
+        assert(buf[t] != 0);
+    }
+    bool ok = true;
+    for (long round = 0; ok && (round < NV_in); round += nT*OUTPUT_BLOCK) {
+        //Blocks are shared out, so a smaller team than nT still renders them all
+        #pragma omp parallel for num_threads(nT) schedule(static, 1)
+        for (int t = 0; t < nT; t++) {
+            long begin = round + t*OUTPUT_BLOCK;
+            long end = (begin + OUTPUT_BLOCK < NV_in) ? begin + OUTPUT_BLOCK : NV_in;
+            char* p = buf[t];
+            for (long i = begin; i < end; i++) {
+                if (origIds != NULL) {
+                    p += formatLong(p, origIds[i]);
+                    *p++ = ' ';
+                }
+                p += formatLong(p, outputCluster(C, vfMap, i));
+                *p++ = '\n';
+            }
+            len[t] = (begin < end) ? (size_t)(p - buf[t]) : 0;
+        }
+        for (int t = 0; ok && (t < nT); t++) {
+            ok = writeAll(fd, buf[t], len[t]);
+        }
+    }
+    ok = (close(fd) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "Error writing file %s\n", filename);
+    }
+    for (int t = 0; t < nT; t++) {
+        free(buf[t]);
+    }
+    free(buf);
+    free(len);
+    return ok;
+} // End of writeClusterText
+
+// function : writeClusterBinary
+// The cluster of every input vertex as native int32 or int64 values (width 4 or
+// 8), in input vertex order, with a single write. C is written as is when no
+// conversion is needed.
+bool writeClusterBinary(const char* filename, const vertexId* C, const vertexId* vfMap,
+                        long NV_in, int width) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open file %s for writing\n", filename);
+        return false;
+    }
+    const char* data = (const char*)C;
+    char* converted = NULL;
+    if ((vfMap != NULL) || (width != sizeof(vertexId))) {
+        converted = (char*)malloc(NV_in*width);
+        assert(converted != 0);
+        if (width == 4) {
+            int* out = (int*)converted;
+            #pragma omp parallel for
+            for (long i = 0; i < NV_in; i++) {
+                out[i] = (int)outputCluster(C, vfMap, i);
+            }
+        } else {
+            long* out = (long*)converted;
+            #pragma omp parallel for
+            for (long i = 0; i < NV_in; i++) {
+                out[i] = outputCluster(C, vfMap, i);
+            }
+        }
+        data = converted;
+    }
+    bool ok = writeAll(fd, data, NV_in*width);
+    ok = (close(fd) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "Error writing file %s\n", filename);
+    }
+    free(converted);
+    return ok;
+} // End of writeClusterBinary
+
+// function : writeClusterFiles
+// Write the clusters in the format selected by -o/-w; tag is appended to the file names
+void writeClusterFiles(const clusteringParams* inputParams, const char* tag, const vertexId* C_orig,
+        const vertexId* vfMap, const long* origIds, long NV_in) {
+    char outFile[256];
+    double writeTime = omp_get_wtime();
+    if (inputParams->outWidth == 0) {
+        sprintf(outFile,"%s_clustInfo%s", inputParams->inFile, tag);
+        printf("Cluster information will be stored in file: %s\n", outFile);
+        writeClusterText(outFile, C_orig, vfMap, origIds, NV_in);
+    } else {
+        sprintf(outFile,"%s_clustInfo%s.int%d", inputParams->inFile, tag, 8*inputParams->outWidth);
+        printf("Cluster information will be stored in file: %s\n", outFile);
+        writeClusterBinary(outFile, C_orig, vfMap, NV_in, inputParams->outWidth);
+    }
+    printf("Time to write the clusters: %3.3lf\n", omp_get_wtime() - writeTime);
+} // End of writeClusterFiles
+
+// function : runResolutionSweep
+// Cluster G at every resolution of -g concurrently. The threads are split
+// between the runs; the input graph and its vertex degrees are shared
+// read-only, while every run has its own cluster arrays, coarser levels,
+// dendrogram and output files (named with the suffix _g<resolution>).
+// Prints a summary of all runs and frees G.
+void runResolutionSweep(graph* G, const vertexId* vfMap, const long* origIds, long NV_in,
+        int coloring, const clusteringParams* inputParams, int nT, const vertexId* startSeed,
+        const unsigned char* startActive) {
+    int numRuns = inputParams->numResolutions;
+    long NV = G->numVertices;
+    double* vDegree = (double*)malloc(NV * sizeof(double));
+    assert(vDegree != 0);
+    sumVertexDegree(G->edgeWeights, G->edgeListPtrs, vDegree, NV, NULL);
+    double* modularity = (double*)malloc(numRuns * sizeof(double));
+    assert(modularity != 0);
+    long* numClusters = (long*)malloc(numRuns * sizeof(long));
+    assert(numClusters != 0);
+    double* runTime = (double*)malloc(numRuns * sizeof(double));
+    assert(runTime != 0);
+
+    int outer = (numRuns < nT) ? numRuns : nT; // Concurrent runs
+    int inner = nT / outer; // Threads of every run
+    printf("Clustering at %d resolutions, %d at a time with %d threads each\n", numRuns, outer, inner);
+    omp_set_max_active_levels(2);
+    #pragma omp parallel for num_threads(outer) schedule(dynamic, 1)
+    for (int r = 0; r < numRuns; r++) {
+        omp_set_num_threads(inner); // For the parallel regions of this run
+        double resolution = inputParams->resolutions[r];
+        char tag[64];
+        sprintf(tag, "_g%g", resolution);
+        char levelFile[256];
+        dendrogram* levels = NULL;
+        if (inputParams->levels) {
+            sprintf(levelFile,"%s_dendrogram%s", inputParams->inFile, tag);
+            levels = dendrogramOpen(levelFile, NV_in);
+            if (vfMap != NULL) {
+                dendrogramAddLevel(levels, vfMap, NV);
+            }
+        }
+        vertexId* C_orig = (vertexId*)malloc(NV * sizeof(vertexId));
+        assert(C_orig != 0);
+        #pragma omp parallel for
+        for (long i = 0; i < NV; i++) {
+            C_orig[i] = -1;
+        }
+        double time1 = omp_get_wtime();
+        modularity[r] = runMultiPhaseLouvainAlgorithm(G, C_orig, coloring, inputParams->minGraphSize,
+                inputParams->threshold, inputParams->C_thresh, inner, levels, inputParams->pruneInactive,
+                inputParams->refine, resolution, vDegree, startSeed, startActive, inputParams->coarsenStart);
+        runTime[r] = omp_get_wtime() - time1;
+        long maxCluster = -1; // Cluster ids are contiguous
+        #pragma omp parallel for reduction(max:maxCluster)
+        for (long i = 0; i < NV; i++) {
+            if (C_orig[i] > maxCluster) {
+                maxCluster = C_orig[i];
+            }
+        }
+        numClusters[r] = maxCluster + 1;
+        if ((levels != NULL) && dendrogramClose(levels)) {
+            printf("Dendrogram stored in file: %s\n", levelFile);
+        }
+        if (inputParams->output) {
+            writeClusterFiles(inputParams, tag, C_orig, vfMap, origIds, NV_in);
+        }
+        free(C_orig);
+    }
+
+    printf("********************************************\n");
+    printf("Resolution      Clusters      Modularity      Time\n");
+    for (int r = 0; r < numRuns; r++) {
+        printf("%-15g %-13ld %-15lf %lf\n", inputParams->resolutions[r], numClusters[r],
+                modularity[r], runTime[r]);
+    }
+    printf("********************************************\n");
+
+    free(vDegree);
+    free(modularity);
+    free(numClusters);
+    free(runTime);
+    freeGraph(G);
+} // End of runResolutionSweep
+
 // function : main
 int main(int argc, char** argv) {
     // Step1 : Parse Input Parameters
@@ -2624,13 +5372,126 @@ int main(int argc, char** argv) {
     printf("Value of fType inside main is : %d\n", fType);
     printf("Value of inFile inside main is : %s\n", inFile);
 #endif
-    if (fType == 5) {
-        bool readFileStatus = loadMetisFileFormat(G, inFile);
-        if (!readFileStatus) {
-            fprintf(stderr, "Cannot proceed due to prior mentioned issues in the inputs\n");
-            free(G);
+    bool readFileStatus = false;
+    long* origIds = NULL; // Original vertex ids, for inputs with sparse ids
+    double loadTime = omp_get_wtime();
+    // Text inputs can be served from a binary sidecar written by an earlier run
+    sourceKey source;
+    char* cacheFile = NULL;
+    if (inputParams->cache && (fType != 7) && readSourceKey(inFile, fType, &source)) {
+        cacheFile = (char*)malloc(strlen(inFile) + 5);
+        assert(cacheFile != 0);
+        sprintf(cacheFile, "%s.cgb", inFile);
+        readFileStatus = loadBinaryGraph(G, cacheFile, &origIds, &source);
+        if (readFileStatus) {
+            printf("Loaded the graph from cache: %s\n", cacheFile);
+        }
+    }
+    if (readFileStatus) {
+        // Cache hit
+    } else if (fType == 1) {
+        readFileStatus = loadMatrixMarketFile(G, inFile);
+    } else if ((fType == 3) || (fType == 4)) {
+        readFileStatus = loadPajekFile(G, inFile, fType == 4);
+    } else if (fType == 5) {
+        readFileStatus = loadMetisFileFormat(G, inFile, inputParams->spillDir);
+    } else if (fType == 6) {
+        readFileStatus = loadSimpleEdgeList(G, inFile);
+    } else if (fType == 7) {
+        readFileStatus = loadBinaryGraph(G, inFile, &origIds, NULL);
+    } else if (fType == 8) {
+        readFileStatus = loadSnapFile(G, inFile, &origIds);
+    } else {
+        fprintf(stderr, "File type %d is not supported yet\n", fType);
+    }
+    if (!readFileStatus) {
+        fprintf(stderr, "Cannot proceed due to prior mentioned issues in the inputs\n");
+        free(cacheFile);
+        free(G);
+        free(inputParams);
+        return -1;
+    }
+    printf("Time to load the graph: %3.3lf\n", omp_get_wtime() - loadTime);
+    if ((cacheFile != NULL) && (G->mapBase == NULL)) {
+        // Parsed from text: (re)write the cache; a failure only costs the next run a parse
+        if (writeGraphCache(G, origIds, &source, cacheFile)) {
+            printf("Wrote the graph cache: %s\n", cacheFile);
+        }
+    }
+    free(cacheFile);
+
+    // Edge batch: patch the loaded graph
+    unsigned char* affected = NULL; // Vertices near the updates
+    if (inputParams->batchFile != NULL) {
+        if (!applyEdgeBatch(G, inputParams->batchFile, origIds != NULL, &affected)) {
+            fprintf(stderr, "Cannot apply the edge batch %s\n", inputParams->batchFile);
+            freeGraph(G);
+            free(origIds);
+            free(inputParams);
+            return -1;
+        }
+    }
+    // Start clusters: before the batch (-i) or a warm start (-p)
+    const char* partitionFile = (inputParams->priorFile != NULL) ? inputParams->priorFile : inputParams->startFile;
+    long* prior = NULL;
+    long numPrior = 0;
+    if (partitionFile != NULL) {
+        double partitionTime = omp_get_wtime();
+        prior = (long*)malloc(G->numVertices * sizeof(long));
+        assert(prior != 0);
+        numPrior = loadPartition(partitionFile, G->numVertices, prior);
+        if (numPrior < 0) {
+            freeGraph(G);
+            free(affected);
+            free(prior);
+            free(origIds);
+            free(inputParams);
+            return -1;
+        }
+        printf("Time to load the start clusters: %3.3lf\n", omp_get_wtime() - partitionTime);
+    }
+
+    // Validation (and repair) right after loading
+    if (inputParams->check) {
+        graphCheck report;
+        double checkTime = omp_get_wtime();
+        bool clean = checkGraph(G, &report);
+        displayGraphCheck(G, &report);
+        if (!clean && inputParams->repair) {
+            if ((report.outOfRange == 0) && (report.selfLoops == 0) && (report.duplicates == 0)
+                    && report.symmetric) {
+                G->numEdges = report.countedEdges; // Only the stored edge count was wrong
+            } else {
+                repairGraph(G);
+            }
+            printf("Repaired graph: %ld edges\n", G->numEdges);
+        } else if ((report.outOfRange > 0) || !report.symmetric) {
+            fprintf(stderr, "Cannot cluster a graph with out-of-range neighbors or missing mirror edges;"
+                    " rerun with -r to repair it\n");
+            freeGraph(G);
+            free(affected);
+            free(prior);
+            free(origIds);
+            free(inputParams);
             return -1;
+        } else if (!clean) {
+            printf("Warning: the input has problems; rerun with -r to repair it\n");
+        }
+        printf("Time to check the graph: %3.3lf\n", omp_get_wtime() - checkTime);
+    }
+
+    // Converter mode: store the graph in binary format and stop
+    if (inputParams->binFile != NULL) {
+        bool writeStatus = writeBinaryGraph(G, origIds, NULL, inputParams->binFile);
+        if (writeStatus) {
+            printf("Binary graph written to file: %s\n", inputParams->binFile);
         }
+        freeGraph(G);
+        free(affected);
+        free(prior);
+        free(origIds);
+        free(inputParams);
+        return writeStatus ? 0 : -1;
     }
 
 displayGraphCharacteristics(G);
@@ -2639,11 +5500,21 @@ if (inputParams->coloring) {
     coloring = 1;
 }
 
+// Dendrogram of all phases; level 0 is the input graph
+char levelFile[256];
+dendrogram* levels = NULL;
+if (inputParams->levels && (inputParams->numResolutions == 1)) {
+    sprintf(levelFile,"%s_dendrogram", inputParams->inFile);
+    levels = dendrogramOpen(levelFile, G->numVertices);
+}
+
 // Vertex Following option
+long NV_in = G->numVertices;
+vertexId* vfMap = NULL; // Vertex of the modified graph for every input vertex, -1 if dropped
 if (inputParams->VF) {
     printf("Vertex following is enabled.\n");
     long numVtxToFix = 0; // Default 0
-    long* C = (long*)malloc(G->numVertices*sizeof(long));
+    vertexId* C = (vertexId*)malloc(G->numVertices*sizeof(vertexId));
     assert(C != 0);
     // Find vertices that follow other vertices
     numVtxToFix = vertexFollowing(G, C);
@@ -2655,19 +5526,58 @@ if (inputParams->VF) {
         graph *Gnew = (graph *)malloc(sizeof(graph));
         long numClusters = renumberClustersContiguously(C, G->numVertices);    
         buildNewGraphVF(G, Gnew, C, numClusters);
-        free(G->edgeListPtrs);
-        free(G->edgeList);
-        free(G);
+        freeGraph(G);
         G = Gnew;
+        vfMap = C; // Keep the mapping for the output
+        dendrogramAddLevel(levels, vfMap, numClusters); // Vertex following is the first merge
+    } else {
+        free(C); // Free up memory
     }
-    free(C); // Free up memory
     printf("Graph after modifications:\n");
     displayGraphCharacteristics(G);
 } // End of if (VF == 1)
 
+// Start clusters; in incremental mode only the vertices near the batch are active at first
+vertexId* startSeed = NULL;
+unsigned char* startActive = NULL;
+if (prior != NULL) {
+    startSeed = (vertexId*)malloc(G->numVertices * sizeof(vertexId));
+    assert(startSeed != 0);
+    partitionSeed(prior, numPrior, vfMap, NV_in, G->numVertices, startSeed);
+    printf("Starting from the clusters of %ld vertices in %s\n", numPrior, partitionFile);
+    free(prior);
+}
+if ((startSeed != NULL) && (inputParams->priorFile != NULL)) {
+    startActive = (unsigned char*)malloc(G->numVertices * sizeof(unsigned char));
+    assert(startActive != 0);
+    #pragma omp parallel for
+    for (long v = 0; v < G->numVertices; v++) {
+        startActive[v] = 0;
+    }
+    #pragma omp parallel for
+    for (long i = 0; i < NV_in; i++) {
+        long v = (vfMap == NULL) ? i : vfMap[i];
+        if ((v >= 0) && affected[i]) {
+            startActive[v] = 1; // Racing writers all store 1
+        }
+    }
+}
+free(affected);
+
+// Several resolutions: concurrent runs on the shared graph, each with its own outputs
+if (inputParams->numResolutions > 1) {
+    runResolutionSweep(G, vfMap, origIds, NV_in, coloring, inputParams, nT, startSeed, startActive);
+    free(startSeed);
+    free(startActive);
+    free(vfMap);
+    free(origIds);
+    free(inputParams);
+    return 0;
+}
+
 // Datastructures to store clustering information
 long NV = G->numVertices;
-long* C_orig = (long*)malloc(NV * sizeof(long));
+vertexId* C_orig = (vertexId*)malloc(NV * sizeof(vertexId));
 
 // Call the clustering algorithm
 // They call strong scaling - I don't know what to do
@@ -2680,32 +5590,33 @@ for (int i = 0; i < NV; i++) {
 
 unsigned long long start = 0, end = 0, sum = 0;
 start = rdtsc();
-runMultiPhaseLouvainAlgorithm(G, C_orig, coloring, inputParams->minGraphSize, inputParams->threshold, inputParams->C_thresh, nT);
+runMultiPhaseLouvainAlgorithm(G, C_orig, coloring, inputParams->minGraphSize, inputParams->threshold, inputParams->C_thresh, nT, levels, inputParams->pruneInactive, inputParams->refine, inputParams->resolutions[0], NULL,
+        startSeed, startActive, inputParams->coarsenStart);
 end = rdtsc();
 sum = (end - start);
 
 printf("Recorded number of cycles : %lld\n", sum);
 
+if ((levels != NULL) && dendrogramClose(levels)) {
+    printf("Dendrogram stored in file: %s\n", levelFile);
+}
+
 //Check if cluster ids need to be written to a file:
 if( inputParams->output ) {
-    char outFile[256];
-    sprintf(outFile,"%s_clustInfo", inputParams->inFile);
-    printf("Cluster information will be stored in file: %s\n", outFile);
-    FILE* out = fopen(outFile,"w");
-    for(long i = 0; i<NV;i++) {
-        fprintf(out,"%ld\n",C_orig[i]);
-    }
-    fclose(out);
+    writeClusterFiles(inputParams, "", C_orig, vfMap, origIds, NV_in);
 }
 
 //Cleanup:
 if(C_orig != 0) free(C_orig);
+free(startSeed);
+free(startActive);
+free(vfMap);
+free(origIds);
 
 
 // Free the memory space allocated for struct clusteringParams
 free(inputParams);
-// Free the memory space allocated for struct graph
-free(G);
+// Note: struct graph is freed by runMultiPhaseLouvainAlgorithm
 
 return 0;
 }